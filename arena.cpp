@@ -0,0 +1,144 @@
+
+#include <arena.h>
+#include <common.h>
+#include <errlog.h>
+#include <memStats.h>
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/thread.hpp>
+
+static boost::mutex &registryMutex()
+{
+    static boost::mutex mutex;
+    return mutex;
+}
+
+static std::vector<Arena*> &registry()
+{
+    static std::vector<Arena*> arenas;
+    return arenas;
+}
+
+Arena::Arena(
+    const char *name,
+    size_t     size
+)
+{
+    nbStarted = 0;
+    chunkSize = size;
+    p = 0;
+    end = 0;
+    used = 0;
+    peak = 0;
+    reserved = 0;
+    nbAllocs = 0;
+    nbResets = 0;
+    snprintf(label, sizeof(label), "%s", name);
+
+    boost::lock_guard<boost::mutex> lock(registryMutex());
+    registry().push_back(this);
+}
+
+Arena::~Arena()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(registryMutex());
+        std::vector<Arena*> &arenas = registry();
+        arenas.erase(std::remove(arenas.begin(), arenas.end(), this), arenas.end());
+    }
+
+    for(size_t i=0; i<chunks.size(); ++i) hugeFree(chunks[i].p, chunks[i].size);
+}
+
+// Move on to the next chunk, reusing the one a reset left there if it is
+// big enough. Allocations bigger than a chunk get a chunk of their own
+void *Arena::grow(
+    size_t size,
+    size_t align
+)
+{
+    size_t need = size + align - 1;
+    if(chunks.size()<=nbStarted || chunks[nbStarted].size<need) {
+
+        Chunk chunk;
+        chunk.size = chunkSize;
+        if(chunk.size<need) chunk.size = ((need + chunkSize - 1)/chunkSize)*chunkSize;
+        chunk.p = (uint8_t*)hugeAlloc(chunk.size);
+        chunks.insert(chunks.begin() + nbStarted, chunk);
+        reserved += chunk.size;
+    }
+
+    if(peak<used) peak = used;
+
+    const Chunk &chunk = chunks[nbStarted++];
+    p = chunk.p;
+    end = chunk.size + chunk.p;
+    return alloc(size, align);
+}
+
+void Arena::reset(
+    const Mark &m
+)
+{
+    if(peak<used) peak = used;
+
+    nbStarted = m.nbStarted;
+    p = m.p;
+    end = (0<nbStarted) ? chunks[nbStarted - 1].size + chunks[nbStarted - 1].p : 0;
+    used = m.used;
+    ++nbResets;
+}
+
+void Arena::reset()
+{
+    Mark m;
+    m.nbStarted = 0;
+    m.p = 0;
+    m.used = 0;
+    reset(m);
+}
+
+static __thread int gArenaThread = -1;
+static __thread Arena *gThreadArena;
+static __thread Arena *gBlockArena;
+static int gNbArenaThreads;
+
+static int arenaThread()
+{
+    if(unlikely(gArenaThread<0)) gArenaThread = __sync_fetch_and_add(&gNbArenaThreads, 1);
+    return gArenaThread;
+}
+
+// Arenas of threads that are gone stay around: what they hold is still in use
+Arena &threadArena()
+{
+    if(unlikely(0==gThreadArena)) {
+        char name[32];
+        snprintf(name, sizeof(name), "run/%d", arenaThread());
+        gThreadArena = new Arena(name);
+    }
+    return *gThreadArena;
+}
+
+// Blocks need little scratch space: chunks too small for huge pages
+Arena &blockArena()
+{
+    if(unlikely(0==gBlockArena)) {
+        char name[32];
+        snprintf(name, sizeof(name), "block/%d", arenaThread());
+        gBlockArena = new Arena(name, 64*1024);
+    }
+    return *gBlockArena;
+}
+
+void arenaStats(
+    MemStats &stats
+)
+{
+    boost::lock_guard<boost::mutex> lock(registryMutex());
+    const std::vector<Arena*> &arenas = registry();
+    for(size_t i=0; i<arenas.size(); ++i) stats.add(*arenas[i]);
+}
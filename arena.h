@@ -0,0 +1,103 @@
+#ifndef __ARENA_H__
+    #define __ARENA_H__
+
+    #include <vector>
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <common.h>
+    #include <hugePages.h>
+
+    struct MemStats;
+
+    // Bump allocator over huge page chunks. Objects are never freed one by
+    // one: an arena gets rewound to a mark, which hands everything allocated
+    // since back to later allocations, chunks and all. Chunks only go back
+    // to the system when the arena is destroyed.
+    //
+    // An arena is not thread safe. Threads get arenas of their own from
+    // threadArena() and blockArena() and so never contend on allocation.
+    struct Arena
+    {
+        struct Mark
+        {
+            size_t   nbStarted;
+            uint8_t  *p;
+            uint64_t used;
+        };
+
+        Arena(const char *name, size_t chunkSize = kHugePageSize);
+        ~Arena();
+
+        void *alloc(
+            size_t size,
+            size_t align = 8
+        )
+        {
+            uintptr_t r = ((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1);
+            if(unlikely((uintptr_t)end<size + r)) return grow(size, align);
+
+            p = (uint8_t*)(size + r);
+            used += size;
+            ++nbAllocs;
+            return (void*)r;
+        }
+
+        Mark mark() const
+        {
+            Mark m;
+            m.nbStarted = nbStarted;
+            m.p = p;
+            m.used = used;
+            return m;
+        }
+
+        // Everything allocated since m is gone
+        void reset(const Mark &m);
+        void reset();
+
+        const char *name() const { return label;        }
+        uint64_t usedBytes() const { return used;       }
+        uint64_t reservedBytes() const { return reserved; }
+        uint64_t peakBytes() const { return used<peak ? peak : used; }
+        uint64_t allocCount() const { return nbAllocs;  }
+        uint64_t resetCount() const { return nbResets;  }
+
+    private:
+        struct Chunk
+        {
+            uint8_t *p;
+            size_t  size;
+        };
+
+        Arena(const Arena &);
+        Arena &operator=(const Arena &);
+
+        void *grow(size_t size, size_t align);
+
+        std::vector<Chunk> chunks;
+        size_t             nbStarted;   // Chunks handed out from, the last one being the current one
+        size_t             chunkSize;
+        uint8_t            *p;
+        uint8_t            *end;
+        uint64_t           used;
+        uint64_t           peak;
+        uint64_t           reserved;
+        uint64_t           nbAllocs;
+        uint64_t           nbResets;
+        char               label[32];
+    };
+
+    // This thread's arena for what lives as long as the run: blocks, and
+    // hashes held by maps. Outlives the thread
+    Arena &threadArena();
+
+    // This thread's arena for what lives as long as the block being parsed:
+    // the second pass resets it ahead of each startBlock, and so does each
+    // multi consumer thread ahead of handing its command a startBlock
+    Arena &blockArena();
+
+    // Add every arena that saw an allocation to a memory report
+    void arenaStats(MemStats &stats);
+
+#endif // __ARENA_H__
+
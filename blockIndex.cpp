@@ -0,0 +1,198 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <blockIndex.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct BlockIndexHeader
+{
+    uint64_t magic;
+    uint64_t nbFiles;
+    uint64_t nbBlocks;
+    int64_t  maxBlock;
+};
+
+static const uint64_t kBlockIndexMagic = 0x3130584449504221ULL; // "!BPIDX01"
+
+BlockIndex::BlockIndex()
+{
+    fd = -1;
+    map = 0;
+    mapSize = 0;
+    fileCount = 0;
+    blockCount = 0;
+    maxEntry = kNoBlockRef;
+    fileTable = 0;
+    entryTable = 0;
+}
+
+BlockIndex::~BlockIndex()
+{
+    unload();
+}
+
+void BlockIndex::unload()
+{
+    if(map) munmap(map, mapSize);
+    if(0<=fd) close(fd);
+
+    fd = -1;
+    map = 0;
+    mapSize = 0;
+    fileCount = 0;
+    blockCount = 0;
+    maxEntry = kNoBlockRef;
+    fileTable = 0;
+    entryTable = 0;
+}
+
+bool BlockIndex::load(
+    const std::string &path
+)
+{
+    unload();
+
+    fd = open(path.c_str(), O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(fd, &statBuf);
+    if(r<0) {
+        sysErr("failed to fstat block index %s", path.c_str());
+        unload();
+        return false;
+    }
+
+    mapSize = statBuf.st_size;
+    if(mapSize<sizeof(BlockIndexHeader)) {
+        warning("ignoring truncated block index %s", path.c_str());
+        unload();
+        return false;
+    }
+
+    map = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(((void*)-1)==map) {
+        sysErr("failed to mmap block index %s", path.c_str());
+        map = 0;
+        unload();
+        return false;
+    }
+
+    const BlockIndexHeader *header = (const BlockIndexHeader*)map;
+    bool ok =
+        kBlockIndexMagic==header->magic                             &&
+        header->nbFiles<=mapSize/sizeof(BlockIndexFile)             &&
+        header->nbBlocks<=mapSize/sizeof(BlockIndexEntry)
+    ;
+    if(ok) {
+        uint64_t expectedSize =
+            sizeof(BlockIndexHeader)                    +
+            header->nbFiles*sizeof(BlockIndexFile)      +
+            header->nbBlocks*sizeof(BlockIndexEntry)
+        ;
+        ok = (expectedSize==mapSize);
+    }
+
+    if(ok) {
+        fileCount = header->nbFiles;
+        blockCount = header->nbBlocks;
+        maxEntry = header->maxBlock;
+        fileTable = (const BlockIndexFile*)(1 + header);
+        entryTable = (const BlockIndexEntry*)(fileCount + fileTable);
+        ok = validRef(maxEntry) && valid();
+    }
+
+    if(!ok) {
+        warning("ignoring corrupt block index %s", path.c_str());
+        unload();
+        return false;
+    }
+    return true;
+}
+
+bool BlockIndex::validRef(
+    int64_t ref
+) const
+{
+    return
+        kNoBlockRef==ref                            ||
+        kNullBlockRef==ref                          ||
+        (0<=ref && ref<(int64_t)blockCount)
+    ;
+}
+
+// Entries get used as they are to index blk file maps and the block array:
+// each must sit inside the scanned part of the file it is listed under, and
+// point at entries that exist. A blk file that still matches its entry in
+// the index is at least scanEnd bytes long, so its blocks are all mapped
+bool BlockIndex::valid() const
+{
+    uint64_t first = 0;
+    for(uint64_t i=0; i<fileCount; ++i) {
+
+        const BlockIndexFile &file = fileTable[i];
+        if(file.size<file.scanEnd) return false;
+        if(blockCount - first<file.nbBlocks) return false;
+
+        const BlockIndexEntry *entry = first + entryTable;
+        const BlockIndexEntry *last = file.nbBlocks + entry;
+        first += file.nbBlocks;
+
+        while(entry<last) {
+            const BlockIndexEntry &e = *(entry++);
+            bool ok =
+                i==e.fileId                         &&
+                80<=e.size                          &&
+                e.offset<=file.scanEnd              &&
+                e.size<=file.scanEnd - e.offset     &&
+                -1<=e.height                        &&
+                e.height<=(int64_t)blockCount       &&
+                validRef(e.prev)                    &&
+                validRef(e.next)
+            ;
+            if(!ok) return false;
+        }
+    }
+    return first==blockCount;
+}
+
+bool BlockIndex::save(
+    const std::string                   &path,
+    const std::vector<BlockIndexFile>   &files,
+    const std::vector<BlockIndexEntry>  &entries,
+    int64_t                             maxBlock
+)
+{
+    std::string tmpName = path + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "wb");
+    if(!f) {
+        sysErr("failed to create block index %s", tmpName.c_str());
+        return false;
+    }
+
+    BlockIndexHeader header;
+    header.magic = kBlockIndexMagic;
+    header.nbFiles = files.size();
+    header.nbBlocks = entries.size();
+    header.maxBlock = maxBlock;
+
+    bool ok = (1==fwrite(&header, sizeof(header), 1, f));
+    if(ok && 0<files.size()) ok = (files.size()==fwrite(&files[0], sizeof(BlockIndexFile), files.size(), f));
+    if(ok && 0<entries.size()) ok = (entries.size()==fwrite(&entries[0], sizeof(BlockIndexEntry), entries.size(), f));
+    ok = (0==fclose(f)) && ok;
+
+    if(ok) ok = (0==rename(tmpName.c_str(), path.c_str()));
+    if(!ok) {
+        sysErr("failed to write block index %s", path.c_str());
+        unlink(tmpName.c_str());
+    }
+    return ok;
+}
+
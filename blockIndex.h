@@ -0,0 +1,73 @@
+#ifndef __BLOCKINDEX_H__
+    #define __BLOCKINDEX_H__
+
+    #include <string>
+    #include <vector>
+    #include <util.h>
+    #include <common.h>
+
+    // What the first pass found in one blk file
+    struct BlockIndexFile
+    {
+        uint64_t size;                          // Byte size of the blk file when it was indexed
+        int64_t  mtime;                         // Modification time (ns) of the blk file when it was indexed
+        uint64_t scanEnd;                       // Offset at which the first pass stopped scanning the file
+        uint64_t nbBlocks;                      // Number of blocks found in the file
+        char     reason[128];                   // Why the first pass stopped scanning the file
+    };
+
+    // One block found by the first pass
+    struct BlockIndexEntry
+    {
+        uint256_t hash;                         // Block hash
+        uint32_t  fileId;                       // Index of blk file holding the block
+        uint32_t  size;                         // Byte size of block
+        uint64_t  offset;                       // Offset of block data (past magic and size) in blk file
+        int64_t   height;                       // Height of block, -1 if it could not be linked
+        int64_t   prev;                         // Entry index of previous block (or kNullBlockRef / kNoBlockRef)
+        int64_t   next;                         // Entry index of next block on longest chain (or kNoBlockRef)
+    };
+
+    // Sidecar index file, lets the parser rebuild the block chain without re-hashing every header
+    struct BlockIndex
+    {
+        enum {
+            kNoBlockRef = -1,
+            kNullBlockRef = -2
+        };
+
+        BlockIndex();
+        ~BlockIndex();
+
+        bool load(const std::string &path);    // mmap and validate an existing index, false if there is none
+        void unload();
+
+        uint64_t                 nbFiles() const { return fileCount;   }
+        uint64_t                nbBlocks() const { return blockCount;  }
+        int64_t                 maxBlock() const { return maxEntry;    }
+        const BlockIndexFile      *files() const { return fileTable;   }
+        const BlockIndexEntry   *entries() const { return entryTable;  }
+
+        static bool save(
+            const std::string                   &path,
+            const std::vector<BlockIndexFile>   &files,
+            const std::vector<BlockIndexEntry>  &entries,
+            int64_t                             maxBlock
+        );
+
+    private:
+        bool validRef(int64_t ref) const;
+        bool valid() const;
+
+        int                   fd;
+        void                  *map;
+        size_t                mapSize;
+        uint64_t              fileCount;
+        uint64_t              blockCount;
+        int64_t               maxEntry;
+        const BlockIndexFile  *fileTable;
+        const BlockIndexEntry *entryTable;
+    };
+
+#endif // __BLOCKINDEX_H__
+
@@ -0,0 +1,1021 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <taskPool.h>
+#include <blockSource.h>
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <boost/thread.hpp>
+#include <zstd.h>
+
+static const uint64_t kPageSize = sysconf(_SC_PAGESIZE);
+static const uint64_t kChunkSize = 4*1024*1024;      // Unit of explicit reads
+static const unsigned kURingDepth = 8;               // Chunks in flight through an io_uring
+static const uint32_t kSkippableMagic = 0x184D2A5E;  // zstd skippable frame holding a seek table
+static const uint32_t kSeekableMagic = 0x8F92EAB1;   // End of a zstd seek table
+
+// Plain mmap: blocks get paged in as the parser faults on them, hints go
+// straight to madvise
+struct MMapSource:public BlockSource
+{
+    bool     populate;
+    uint32_t nbFiles;
+
+    MMapSource(
+        bool _populate
+    )
+    {
+        populate = _populate;
+        nbFiles = 0;
+    }
+
+    virtual const char *name() const { return "mmap"; }
+
+    virtual void open(
+        BlockFile &file
+    )
+    {
+        int flags = MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+        void *pMap = mmap(0, file.size, PROT_READ, flags, file.fd, 0);
+        if(((void*)-1)==pMap) {
+            sysErrFatal(
+                "failed to mmap block chain file %s",
+                file.name.c_str()
+            );
+        }
+
+        file.id = nbFiles++;
+        file.p = (const uint8_t*)pMap;
+    }
+
+    virtual void close(
+        const BlockFile &file
+    )
+    {
+        int r = munmap((void*)file.p, file.size);
+        if(r<0) sysErr("failed to unmap block chain file %s", file.name.c_str());
+    }
+
+    void advise(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end,
+        int             advice
+    )
+    {
+        start &= ~(kPageSize - 1);
+        if(file.size<end) end = file.size;
+        if(end<=start) return;
+
+        int r = madvise((void*)(start + file.p), end - start, advice);
+        if(r<0) sysErr("failed to madvise block chain file %s", file.name.c_str());
+    }
+
+    virtual void access(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end,
+        Access          how
+    )
+    {
+        advise(file, start, end, kSequential==how ? MADV_SEQUENTIAL : MADV_NORMAL);
+    }
+
+    virtual void willNeed(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        advise(file, start, end, MADV_WILLNEED);
+    }
+
+    virtual void wait(
+        const BlockFile &file,
+        uint64_t        end
+    )
+    {
+    }
+
+    // Page cache already is whatever memory the pages hold
+    virtual void retire(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+    }
+
+    virtual void release(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        advise(file, start, end, MADV_DONTNEED);
+    }
+};
+
+// Reads blk files in chunks with explicit I/O, on a loader thread, ahead of
+// the parser. Each file is still mmapped underneath, which keeps its range
+// reserved and lets anything not read in yet fault in as it would with the
+// mmap source. A chunk gets read into an anonymous buffer that then replaces
+// its stretch of the file mapping in one mremap: readers see the same bytes
+// before and after. Retiring a chunk maps the file back over it, which gives
+// its memory back without moving anything.
+struct StreamSource:public MMapSource
+{
+    enum ChunkState
+    {
+        kMapped,                                // File mapping, faults in
+        kQueued,
+        kLoading,
+        kLoaded                                 // Anonymous copy
+    };
+
+    struct File
+    {
+        int                  fd;
+        uint64_t             size;
+        uint8_t              *p;
+        std::string          name;
+        std::vector<uint8_t> chunks;
+    };
+
+    struct Load
+    {
+        uint32_t fileId;
+        uint64_t chunk;
+        int      fd;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t done;
+        uint8_t  *target;
+        uint8_t  *buffer;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;         // Loader waits on the queue, readers on loads
+    std::vector<File> files;
+    std::deque<std::pair<uint32_t, uint64_t> > queue;
+    boost::thread *loader;
+    bool quit;
+
+    StreamSource() : MMapSource(false)
+    {
+        loader = 0;
+        quit = false;
+    }
+
+    // Derived loaders must stop before they tear down what load() uses
+    virtual ~StreamSource()
+    {
+        stop();
+    }
+
+    virtual void load() = 0;
+
+    static void loadThread(
+        StreamSource *source
+    )
+    {
+        source->load();
+    }
+
+    void stop()
+    {
+        if(0==loader) return;
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            quit = true;
+            cond.notify_all();
+        }
+        loader->join();
+        delete loader;
+        loader = 0;
+    }
+
+    virtual void open(
+        BlockFile &file
+    )
+    {
+        MMapSource::open(file);
+
+        File f;
+        f.fd = file.fd;
+        f.size = file.size;
+        f.p = (uint8_t*)file.p;
+        f.name = file.name;
+        f.chunks.resize((file.size + kChunkSize - 1)/kChunkSize, kMapped);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        files.push_back(f);
+    }
+
+    // Loads in flight land in the mapping: let them finish before it goes
+    virtual void close(
+        const BlockFile &file
+    )
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            File &f = files[file.id];
+            while(1) {
+                bool loading = false;
+                for(size_t i=0; i<f.chunks.size(); ++i) {
+                    if(kQueued==f.chunks[i]) f.chunks[i] = kMapped;
+                    if(kLoading==f.chunks[i]) loading = true;
+                }
+                if(!loading) break;
+                cond.wait(lock);
+            }
+            f.p = 0;
+        }
+        MMapSource::close(file);
+    }
+
+    virtual void willNeed(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        if(file.size<end) end = file.size;
+        if(end<=start) return;
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        File &f = files[file.id];
+        for(uint64_t i=start/kChunkSize; i*kChunkSize<end; ++i) {
+            if(kMapped!=f.chunks[i]) continue;
+            f.chunks[i] = kQueued;
+            queue.push_back(std::make_pair(file.id, i));
+        }
+
+        if(0==loader) loader = new boost::thread(loadThread, this);
+        cond.notify_all();
+    }
+
+    virtual void wait(
+        const BlockFile &file,
+        uint64_t        end
+    )
+    {
+        if(file.size<end) end = file.size;
+        uint64_t nbChunks = (end + kChunkSize - 1)/kChunkSize;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        File &f = files[file.id];
+        uint64_t i = 0;
+        while(i<nbChunks) {
+            if(kQueued==f.chunks[i] || kLoading==f.chunks[i]) cond.wait(lock);
+            else ++i;
+        }
+    }
+
+    // Under mutex: put the file mapping back over a loaded chunk
+    void unload(
+        File     &f,
+        uint64_t i
+    )
+    {
+        uint64_t offset = i*kChunkSize;
+        uint64_t size = std::min(kChunkSize, f.size - offset);
+        void *pMap = mmap(offset + f.p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, f.fd, offset);
+        if(((void*)-1)==pMap) sysErrFatal("failed to remap block chain file %s", f.name.c_str());
+        f.chunks[i] = kMapped;
+    }
+
+    // Only chunks that fall entirely within [start, end) go
+    virtual void retire(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        if(file.size<end) end = file.size;
+        uint64_t first = (start + kChunkSize - 1)/kChunkSize;
+        uint64_t last = (file.size==end) ? (end + kChunkSize - 1)/kChunkSize : end/kChunkSize;
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        File &f = files[file.id];
+        for(uint64_t i=first; i<last; ++i) {
+            if(kQueued==f.chunks[i]) f.chunks[i] = kMapped;
+            if(kLoaded==f.chunks[i]) unload(f, i);
+        }
+    }
+
+    // Dropping the pages of a loaded chunk would zero it: only chunks back on
+    // the file mapping get their pages dropped
+    virtual void release(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        retire(file, start, end);
+
+        if(file.size<end) end = file.size;
+        if(end<=start) return;
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        File &f = files[file.id];
+        for(uint64_t i=start/kChunkSize; i*kChunkSize<end; ++i) {
+            if(kMapped!=f.chunks[i]) continue;
+            uint64_t chunkStart = std::max(start, i*kChunkSize);
+            uint64_t chunkEnd = std::min(end, (i + 1)*kChunkSize);
+            advise(file, chunkStart, chunkEnd, MADV_DONTNEED);
+        }
+    }
+
+    // Under mutex: next chunk the loader should read, false if there is none
+    bool nextLoad(
+        Load &load
+    )
+    {
+        while(!queue.empty()) {
+
+            std::pair<uint32_t, uint64_t> next = queue.front();
+            queue.pop_front();
+
+            File &f = files[next.first];
+            if(kQueued!=f.chunks[next.second]) continue;
+            f.chunks[next.second] = kLoading;
+
+            load.fileId = next.first;
+            load.chunk = next.second;
+            load.fd = f.fd;
+            load.offset = next.second*kChunkSize;
+            load.size = std::min(kChunkSize, f.size - load.offset);
+            load.done = 0;
+            load.target = load.offset + f.p;
+            load.buffer = 0;
+            return true;
+        }
+        return false;
+    }
+
+    void allocBuffer(
+        Load &load
+    )
+    {
+        void *buffer = mmap(0, load.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(((void*)-1)==buffer) sysErrFatal("failed to allocate %" PRIu64 " byte read buffer", load.size);
+        load.buffer = (uint8_t*)buffer;
+    }
+
+    // Swap a fully read chunk in for its stretch of the file mapping
+    void install(
+        Load &load
+    )
+    {
+        int r = mprotect(load.buffer, load.size, PROT_READ);
+        if(r<0) sysErrFatal("failed to protect read buffer");
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        File &f = files[load.fileId];
+        void *pMap = mremap(load.buffer, load.size, load.size, MREMAP_MAYMOVE | MREMAP_FIXED, load.target);
+        if(((void*)-1)==pMap) sysErrFatal("failed to move read buffer into block chain file %s", f.name.c_str());
+
+        f.chunks[load.chunk] = kLoaded;
+        cond.notify_all();
+    }
+
+    void checkRead(
+        const Load &load,
+        int64_t    r
+    )
+    {
+        if(0<r) return;
+
+        const std::string &name = files[load.fileId].name;
+        if(0==r) errFatal("block chain file %s shrank while being read", name.c_str());
+        sysErrFatal("failed to read block chain file %s", name.c_str());
+    }
+};
+
+// One chunk at a time, in request order, with plain pread
+struct ReadSource:public StreamSource
+{
+    virtual const char *name() const { return "read"; }
+
+    virtual void load()
+    {
+        while(1) {
+
+            Load load;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while(!quit && !nextLoad(load)) cond.wait(lock);
+                if(quit) break;
+            }
+
+            allocBuffer(load);
+            while(load.done<load.size) {
+                ssize_t r = pread(load.fd, load.done + load.buffer, load.size - load.done, load.offset + load.done);
+                if(r<0 && EINTR==errno) continue;
+                checkRead(load, r);
+                load.done += r;
+            }
+            install(load);
+        }
+    }
+};
+
+// Up to kURingDepth chunks in flight at once, submitted and reaped through an
+// io_uring driven with raw syscalls
+struct URingSource:public StreamSource
+{
+    int                 ringFd;
+    uint8_t             *sqRing;
+    uint8_t             *cqRing;
+    size_t              sqRingSize;
+    size_t              cqRingSize;
+    size_t              sqesSize;
+    io_uring_params     params;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    Load                loads[kURingDepth];
+    bool                busy[kURingDepth];
+
+    URingSource()
+    {
+        ringFd = -1;
+        sqRing = 0;
+        cqRing = 0;
+        sqes = 0;
+        cqes = 0;
+        memset(busy, 0, sizeof(busy));
+    }
+
+    virtual ~URingSource()
+    {
+        stop();
+        if(sqes) munmap(sqes, sqesSize);
+        if(cqRing && cqRing!=sqRing) munmap(cqRing, cqRingSize);
+        if(sqRing) munmap(sqRing, sqRingSize);
+        if(0<=ringFd) ::close(ringFd);
+    }
+
+    virtual const char *name() const { return "uring"; }
+
+    // False if the kernel won't give us a ring
+    bool setup()
+    {
+        memset(&params, 0, sizeof(params));
+        ringFd = (int)syscall(__NR_io_uring_setup, kURingDepth, &params);
+        if(ringFd<0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+        bool single = (0!=(params.features & IORING_FEAT_SINGLE_MMAP));
+        if(single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+
+        sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mapRing(sqesSize, IORING_OFF_SQES);
+        cqes = (struct io_uring_cqe*)(params.cq_off.cqes + cqRing);
+        return (0!=sqRing && 0!=cqRing && 0!=sqes);
+    }
+
+    uint8_t *mapRing(
+        size_t   size,
+        uint64_t offset
+    )
+    {
+        void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        return (((void*)-1)==p) ? 0 : (uint8_t*)p;
+    }
+
+    uint32_t *sqField(uint32_t offset) { return (uint32_t*)(offset + sqRing); }
+    uint32_t *cqField(uint32_t offset) { return (uint32_t*)(offset + cqRing); }
+
+    // The kernel reads the tails and writes the heads from its side
+    static uint32_t loadAcquire(
+        const uint32_t *p
+    )
+    {
+        uint32_t v = *(const volatile uint32_t*)p;
+        __sync_synchronize();
+        return v;
+    }
+
+    static void storeRelease(
+        uint32_t *p,
+        uint32_t v
+    )
+    {
+        __sync_synchronize();
+        *(volatile uint32_t*)p = v;
+    }
+
+    // Read whatever of slot's chunk is still missing
+    void submit(
+        unsigned slot
+    )
+    {
+        const Load &load = loads[slot];
+        uint32_t tail = *sqField(params.sq_off.tail);
+        uint32_t index = tail & *sqField(params.sq_off.ring_mask);
+
+        struct io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = load.fd;
+        sqe.off = load.offset + load.done;
+        sqe.addr = (uint64_t)(uintptr_t)(load.done + load.buffer);
+        sqe.len = (uint32_t)(load.size - load.done);
+        sqe.user_data = slot;
+
+        sqField(params.sq_off.array)[index] = index;
+        storeRelease(sqField(params.sq_off.tail), tail + 1);
+    }
+
+    virtual void load()
+    {
+        unsigned nbBusy = 0;
+        while(1) {
+
+            // Fill free slots from the queue, sleep only with nothing in flight
+            unsigned nbNew = 0;
+            unsigned fresh[kURingDepth];
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while(1) {
+                    for(unsigned slot=0; !quit && slot<kURingDepth; ++slot) {
+                        if(busy[slot] || !nextLoad(loads[slot])) continue;
+                        busy[slot] = true;
+                        fresh[nbNew++] = slot;
+                        ++nbBusy;
+                    }
+                    if(0<nbBusy || quit) break;
+                    cond.wait(lock);
+                }
+                if(0==nbBusy) break;
+            }
+
+            for(unsigned i=0; i<nbNew; ++i) {
+                allocBuffer(loads[fresh[i]]);
+                submit(fresh[i]);
+            }
+
+            uint32_t pending = *sqField(params.sq_off.tail) - loadAcquire(sqField(params.sq_off.head));
+            int r = (int)syscall(__NR_io_uring_enter, ringFd, pending, 1, IORING_ENTER_GETEVENTS, 0, 0);
+            if(r<0 && EINTR!=errno) sysErrFatal("io_uring_enter failed");
+
+            uint32_t *cqHead = cqField(params.cq_off.head);
+            uint32_t mask = *cqField(params.cq_off.ring_mask);
+            uint32_t tail = loadAcquire(cqField(params.cq_off.tail));
+            uint32_t head = *cqHead;
+            while(head!=tail) {
+
+                const struct io_uring_cqe &cqe = cqes[head & mask];
+                unsigned slot = (unsigned)cqe.user_data;
+                int32_t res = cqe.res;
+                storeRelease(cqHead, ++head);
+
+                Load &load = loads[slot];
+                if(res<0) errno = -res;
+                checkRead(load, res);
+                load.done += res;
+
+                if(load.done<load.size) {
+                    submit(slot);
+                    continue;
+                }
+
+                install(load);
+                busy[slot] = false;
+                --nbBusy;
+            }
+        }
+    }
+};
+
+// blk files compressed with zstd. The archive gets mapped as is, and its
+// frames decompress straight into a shared mapping of an unlinked cache file
+// next to it, the size of the blocks, on a task pool, in file order. Frames
+// only get queued once a reader waits for, or asks for, bytes less than
+// window ahead of them, the window running over into the archive opened
+// next. Files made of several frames, be it in the zstd seekable format or
+// as plain concatenated frames, decompress on several threads at once.
+// Decompressed pages are backed by the cache file: released ones get dropped
+// and fault back in from it, without being decompressed again
+struct ZstdSource:public BlockSource
+{
+    struct File;
+
+    struct Frame:public Task
+    {
+        File          *file;
+        const uint8_t *src;
+        uint64_t      srcSize;
+        uint64_t      offset;                   // Of its bytes within the blocks
+        uint64_t      size;
+        bool          ready;
+
+        virtual void run();
+    };
+
+    struct File
+    {
+        ZstdSource         *source;
+        const uint8_t      *z;
+        uint64_t           zSize;
+        int                cacheFD;             // -1 if the blocks sit in anonymous memory
+        uint8_t            *p;
+        uint64_t           size;
+        std::string        name;
+        std::vector<Frame> frames;
+        size_t             nbQueued;            // Frames pushed to the pool, in file order
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<File*> files;
+    uint64_t window;
+    TaskPool pool;
+
+    ZstdSource(
+        size_t   nbThreads,
+        uint64_t _window
+    ) : pool(nbThreads)
+    {
+        window = _window;
+    }
+
+    virtual const char *name() const { return "zstd"; }
+
+    void addFrame(
+        File     &f,
+        uint64_t src,
+        uint64_t srcSize,
+        uint64_t size
+    )
+    {
+        Frame frame;
+        frame.file = &f;
+        frame.src = src + f.z;
+        frame.srcSize = srcSize;
+        frame.offset = f.size;
+        frame.size = size;
+        frame.ready = false;
+        f.frames.push_back(frame);
+        f.size += size;
+    }
+
+    // Frame sizes from the seek table a seekable archive ends with, false
+    // if it has none
+    bool readSeekTable(
+        File &f
+    )
+    {
+        if(f.zSize<17) return false;
+
+        uint32_t nbFrames;
+        uint8_t descriptor;
+        uint32_t magic;
+        const uint8_t *footer = f.z + f.zSize - 9;
+        memcpy(&nbFrames, footer, 4);
+        memcpy(&descriptor, footer + 4, 1);
+        memcpy(&magic, footer + 5, 4);
+        if(kSeekableMagic!=magic) return false;
+
+        uint64_t entrySize = (descriptor & 0x80) ? 12 : 8;
+        uint64_t tableSize = nbFrames*entrySize + 9;
+        if(f.zSize<tableSize + 8) return false;
+
+        uint32_t skippable;
+        uint32_t frameSize;
+        const uint8_t *table = footer - nbFrames*entrySize;
+        memcpy(&skippable, table - 8, 4);
+        memcpy(&frameSize, table - 4, 4);
+        if(kSkippableMagic!=skippable || tableSize!=frameSize) return false;
+
+        uint64_t src = 0;
+        uint64_t srcEnd = (table - 8) - f.z;
+        for(uint32_t i=0; i<nbFrames; ++i) {
+            uint32_t srcSize;
+            uint32_t size;
+            memcpy(&srcSize, i*entrySize + table, 4);
+            memcpy(&size, i*entrySize + table + 4, 4);
+            if(srcEnd<src + srcSize) errFatal("corrupt zstd seek table in %s", f.name.c_str());
+            if(0<size) addFrame(f, src, srcSize, size);
+            src += srcSize;
+        }
+        return true;
+    }
+
+    // Without a seek table, every frame has to record its decompressed size
+    void walkFrames(
+        File &f
+    )
+    {
+        uint64_t src = 0;
+        while(src<f.zSize) {
+
+            size_t srcSize = ZSTD_findFrameCompressedSize(src + f.z, f.zSize - src);
+            if(ZSTD_isError(srcSize)) {
+                errFatal(
+                    "corrupt zstd frame at offset %" PRIu64 " of %s: %s",
+                    src,
+                    f.name.c_str(),
+                    ZSTD_getErrorName(srcSize)
+                );
+            }
+
+            unsigned long long size = ZSTD_getFrameContentSize(src + f.z, srcSize);
+            if(ZSTD_CONTENTSIZE_ERROR==size || ZSTD_CONTENTSIZE_UNKNOWN==size) {
+                errFatal(
+                    "zstd frame at offset %" PRIu64 " of %s does not record its size, recompress it with --content-size or in the seekable format",
+                    src,
+                    f.name.c_str()
+                );
+            }
+
+            if(0<size) addFrame(f, src, srcSize, size);
+            src += srcSize;
+        }
+    }
+
+    // Where the blocks of an archive decompress to: a file next to it,
+    // unlinked right away so that nothing is left behind, or anonymous
+    // memory if there is no room for one there
+    uint8_t *mapCache(
+        File &f
+    )
+    {
+        std::string cacheName = f.name + ".cache";
+        f.cacheFD = ::open(cacheName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(0<=f.cacheFD) {
+            unlink(cacheName.c_str());
+            int r = ftruncate(f.cacheFD, f.size);
+            if(r<0) {
+                ::close(f.cacheFD);
+                f.cacheFD = -1;
+            }
+        }
+
+        if(0<=f.cacheFD) {
+            void *p = mmap(0, f.size, PROT_READ | PROT_WRITE, MAP_SHARED, f.cacheFD, 0);
+            if(((void*)-1)==p) sysErrFatal("failed to mmap cache file %s", cacheName.c_str());
+            return (uint8_t*)p;
+        }
+
+        sysErr("failed to create cache file %s, keeping %s decompressed in memory", cacheName.c_str(), f.name.c_str());
+        void *p = mmap(0, f.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(((void*)-1)==p) sysErrFatal("failed to allocate %" PRIu64 " bytes for %s", f.size, f.name.c_str());
+        return (uint8_t*)p;
+    }
+
+    virtual void open(
+        BlockFile &file
+    )
+    {
+        File *f = new File;
+        f->source = this;
+        f->zSize = file.size;
+        f->size = 0;
+        f->name = file.name;
+        f->nbQueued = 0;
+
+        void *z = mmap(0, f->zSize, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if(((void*)-1)==z) sysErrFatal("failed to mmap block chain file %s", file.name.c_str());
+        f->z = (const uint8_t*)z;
+
+        if(!readSeekTable(*f)) walkFrames(*f);
+        if(0==f->size) errFatal("zstd archive %s holds no blocks", file.name.c_str());
+        f->p = mapCache(*f);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        file.id = files.size();
+        file.size = f->size;
+        file.p = f->p;
+        files.push_back(f);
+    }
+
+    // Queue the frames of archive id that start below end, then those of
+    // the archives opened after it, for as far as end runs past its blocks.
+    // Called with mutex held
+    void schedule(
+        uint32_t id,
+        uint64_t end
+    )
+    {
+        while(id<files.size()) {
+
+            File *f = files[id++];
+            if(0==f) continue;
+
+            while(f->nbQueued<f->frames.size()) {
+                Frame &frame = f->frames[f->nbQueued];
+                if(end<=frame.offset) return;
+                pool.push(&frame);
+                ++f->nbQueued;
+            }
+
+            if(end<=f->size) return;
+            end -= f->size;
+        }
+    }
+
+    // Frames can only go once they are done writing to the mapping
+    virtual void close(
+        const BlockFile &file
+    )
+    {
+        File *f = 0;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            f = files[file.id];
+            for(size_t i=0; i<f->nbQueued; ++i) {
+                while(!f->frames[i].ready) cond.wait(lock);
+            }
+            files[file.id] = 0;
+        }
+
+        int r = munmap(f->p, f->size);
+        if(r<0) sysErr("failed to unmap decompressed %s", f->name.c_str());
+        if(0<=f->cacheFD) ::close(f->cacheFD);
+
+        r = munmap((void*)f->z, f->zSize);
+        if(r<0) sysErr("failed to unmap block chain file %s", f->name.c_str());
+
+        delete f;
+    }
+
+    virtual void wait(
+        const BlockFile &file,
+        uint64_t        end
+    )
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        const File *f = files[file.id];
+        schedule(file.id, std::min(end, f->size) + window);
+
+        auto e = f->frames.end();
+        auto i = f->frames.begin();
+        while(i!=e && i->offset<end) {
+            if(i->ready) ++i;
+            else cond.wait(lock);
+        }
+    }
+
+    virtual void willNeed(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        schedule(file.id, std::min(end, file.size));
+    }
+
+    // Nothing to read ahead: frames get decompressed as they are needed
+    virtual void access(const BlockFile &file, uint64_t start, uint64_t end, Access how) {}
+
+    // Dirty pages of the cache file get written back when memory runs short
+    virtual void retire(const BlockFile &file, uint64_t start, uint64_t end) {}
+
+    // Drop the range from the mapping and the page cache, writing it back to
+    // the cache file first if it has to. Frames still decompressing into it
+    // just fault their pages back in
+    virtual void release(
+        const BlockFile &file,
+        uint64_t        start,
+        uint64_t        end
+    )
+    {
+        const File *f = 0;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            f = files[file.id];
+        }
+        if(f->cacheFD<0) return;
+
+        start &= ~(kPageSize - 1);
+        if(file.size<end) end = file.size;
+        if(end<=start) return;
+
+        int r = madvise((void*)(start + file.p), end - start, MADV_DONTNEED);
+        if(r<0) sysErr("failed to madvise decompressed %s", f->name.c_str());
+
+        r = posix_fadvise(f->cacheFD, start, end - start, POSIX_FADV_DONTNEED);
+        if(0!=r) {
+            errno = r;
+            sysErr("failed to fadvise cache file of %s", f->name.c_str());
+        }
+    }
+};
+
+void ZstdSource::Frame::run()
+{
+    static __thread ZSTD_DCtx *dctx = 0;
+    if(unlikely(0==dctx)) dctx = ZSTD_createDCtx();
+
+    size_t r = ZSTD_decompressDCtx(dctx, offset + file->p, size, src, srcSize);
+    if(ZSTD_isError(r)) errFatal("failed to decompress %s: %s", file->name.c_str(), ZSTD_getErrorName(r));
+    if(size!=r) errFatal("zstd frame of %s decompressed to the wrong size", file->name.c_str());
+
+    ZstdSource *source = file->source;
+    boost::lock_guard<boost::mutex> lock(source->mutex);
+    ready = true;
+    source->cond.notify_all();
+}
+
+// Plain blk files go to the backend picked on the command line, archives
+// to a zstd source set up when the first one shows up
+struct MixedSource:public BlockSource
+{
+    BlockSource *plain;
+    BlockSource *zstd;
+    size_t      nbThreads;
+    uint64_t    zstdWindow;
+
+    MixedSource(
+        BlockSource *_plain,
+        size_t      _nbThreads,
+        uint64_t    _zstdWindow
+    )
+    {
+        plain = _plain;
+        zstd = 0;
+        nbThreads = _nbThreads;
+        zstdWindow = _zstdWindow;
+    }
+
+    virtual ~MixedSource()
+    {
+        delete plain;
+        delete zstd;
+    }
+
+    virtual const char *name() const { return plain->name(); }
+
+    BlockSource *of(
+        const BlockFile &file
+    )
+    {
+        return file.compressed ? zstd : plain;
+    }
+
+    virtual void open(
+        BlockFile &file
+    )
+    {
+        static const char suffix[] = ".zst";
+        size_t n = file.name.size();
+        size_t k = sizeof(suffix) - 1;
+        file.compressed = (k<n && 0==file.name.compare(n - k, k, suffix));
+        if(file.compressed && 0==zstd) zstd = new ZstdSource(nbThreads, zstdWindow);
+        of(file)->open(file);
+    }
+
+    virtual void close(const BlockFile &file)                                           { of(file)->close(file);                 }
+    virtual void access(const BlockFile &file, uint64_t start, uint64_t end, Access how) { of(file)->access(file, start, end, how); }
+    virtual void willNeed(const BlockFile &file, uint64_t start, uint64_t end)           { of(file)->willNeed(file, start, end);  }
+    virtual void wait(const BlockFile &file, uint64_t end)                               { of(file)->wait(file, end);             }
+    virtual void retire(const BlockFile &file, uint64_t start, uint64_t end)             { of(file)->retire(file, start, end);    }
+    virtual void release(const BlockFile &file, uint64_t start, uint64_t end)            { of(file)->release(file, start, end);   }
+};
+
+static BlockSource *createPlain(
+    const char *name,
+    bool       populate
+)
+{
+    if(0==strcmp(name, "mmap")) return new MMapSource(populate);
+    if(0==strcmp(name, "read")) return new ReadSource;
+    if(0==strcmp(name, "uring")) {
+        URingSource *source = new URingSource;
+        if(source->setup()) return source;
+
+        sysErr("failed to set up an io_uring, reading blk files with pread instead");
+        delete source;
+        return new ReadSource;
+    }
+    return 0;
+}
+
+BlockSource *BlockSource::create(
+    const char *name,
+    bool       populate,
+    size_t     nbThreads,
+    uint64_t   zstdWindow
+)
+{
+    BlockSource *plain = createPlain(name, populate);
+    return plain ? new MixedSource(plain, nbThreads, zstdWindow) : 0;
+}
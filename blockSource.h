@@ -0,0 +1,69 @@
+#ifndef __BLOCKSOURCE_H__
+    #define __BLOCKSOURCE_H__
+
+    #include <string>
+    #include <common.h>
+
+    // One blk file, mapped whole for the duration of the run
+    struct BlockFile
+    {
+        int           fd;
+        uint32_t      id;               // Order in which the source opened it
+        bool          compressed;       // A blkNNNNN.dat.zst archive
+        uint64_t      size;             // Of the blocks, once decompressed
+        int64_t       mtime;
+        const uint8_t *p;
+        std::string   name;
+    };
+
+    // Where blk file contents come from. Blocks, TX tables and callbacks all
+    // keep pointers into the files, so every backend hands out each file as
+    // one contiguous range that stays put from open to close, whether or not
+    // its bytes are currently in memory. Backends differ in how bytes get in
+    // ahead of the parser and in what it costs to let them go.
+    //
+    // Offsets are byte offsets into the blocks. The hints below never change
+    // what a reader sees, only when the I/O for it happens and how much
+    // memory it holds on to. The one rule: bytes of a compressed file may
+    // only be read once wait() has returned for them.
+    struct BlockSource
+    {
+        enum Access
+        {
+            kNormal,
+            kSequential
+        };
+
+        // "mmap", "read" or "uring", 0 if there is no such backend. zstd
+        // archives get decompressed on nbThreads threads whatever the backend,
+        // at most zstdWindow bytes past what readers wait for
+        static BlockSource *create(const char *name, bool populate, size_t nbThreads, uint64_t zstdWindow);
+
+        virtual ~BlockSource() {}
+        virtual const char *name() const = 0;
+
+        // file.fd, size and name are filled in, open sets id, compressed
+        // and p. A compressed file's size becomes that of its blocks
+        virtual void open(BlockFile &file) = 0;
+        virtual void close(const BlockFile &file) = 0;
+
+        // How [start, end) is going to get read
+        virtual void access(const BlockFile &file, uint64_t start, uint64_t end, Access how) = 0;
+
+        // [start, end) is read next: start getting it in, don't wait for it
+        virtual void willNeed(const BlockFile &file, uint64_t start, uint64_t end) = 0;
+
+        // Wait for whatever willNeed asked for below end, and for all of a
+        // compressed file below end to be decompressed
+        virtual void wait(const BlockFile &file, uint64_t end) = 0;
+
+        // The reader is past [start, end): it must stay readable, but need
+        // not stay in memory on the reader's account
+        virtual void retire(const BlockFile &file, uint64_t start, uint64_t end) = 0;
+
+        // Nothing reads [start, end) for a long while, if ever
+        virtual void release(const BlockFile &file, uint64_t start, uint64_t end) = 0;
+    };
+
+#endif // __BLOCKSOURCE_H__
+
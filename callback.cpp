@@ -13,6 +13,7 @@ typedef std::map<uintptr_t, Callback*> CBMap;
 
 Callback::Callback()
 {
+    stopRequested = false;
     if(0==callbacks) callbacks = new std::vector<Callback*>;
     callbacks->push_back(this);
 }
@@ -136,3 +137,15 @@ void Callback::showAllHelps(
     printf("\n");
 }
 
+void Callback::parseChain()
+{
+    ChainParser<Callback>::parseChain(this);
+}
+
+void Callback::parseRange(
+    const Block *first,
+    const Block *last
+)
+{
+    ChainParser<Callback>::parseRange(this, first, last);
+}
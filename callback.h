@@ -2,25 +2,53 @@
     #define __CALLBACK_H__
 
     struct Block;
+    struct MemStats;
     #include <vector>
     #include <common.h>
     #include <option.h>
 
+    // Second pass events a command can subscribe to. The parser skips the walks
+    // behind events nobody asked for: without input or edge events it hops over
+    // inputs, and a command that only wants blocks never gets TX bytes read at all
+    enum {
+        kBlockEvents  = 1<<0,   // start, startBlock, endBlock: always delivered
+        kTXEvents     = 1<<1,   // startTX, endTX
+        kInputEvents  = 1<<2,   // startInputs, endInputs, startInput, endInput
+        kOutputEvents = 1<<3,   // startOutputs, endOutputs, startOutput, endOutput
+        kEdgeEvents   = 1<<4,   // edge: the parser only resolves upstream TXs for these
+        kAllEvents    = 0x1F
+    };
+
     // Derive from this if you want to add a new command
     struct Callback
     {
         // Housekeeping
         Callback();
+        virtual ~Callback() {}
         typedef optparse::OptionParser Parser;
         static void showAllHelps(bool longHelp);
         static Callback *find(const char *name, bool printList=false);
 
+        // Ask the parser to stop, from any hook: it finishes the block in progress (or skips
+        // it entirely when called from startBlock), then winds down and calls wrapup as usual
+        void stop() { stopRequested = true; }
+        bool stopRequested;
+
         // Naming, option parsing, construction, etc ...
         virtual const char           *name(                            ) const = 0;              // Main name for callback
         virtual const Parser *optionParser(                            ) const = 0;              // Option parser object for callback
         virtual void               aliases(std::vector<const char *> &v) const {               } // Alternate names for callback
         virtual int                   init(int argc, const char *argv[])       { return 0;     } // Called after callback construction, with command line arguments
         virtual bool            needTXHash(                            ) const { return false; } // Overload if you need parser to compute TX hashes
+        virtual uint32_t            events(                            ) const { return kAllEvents; } // Overload to only get some of the second pass events
+        virtual bool           asyncEvents(                            ) const { return false; } // Overload if hooks may run after the parser moved on to later events
+        virtual void              memStats(MemStats &stats             ) const {               } // Overload to add the command's big structures to memory reports, taken between blocks
+
+        // Commands whose second pass state merges, like plain counters, may get the chain cut
+        // into height ranges parsed in parallel: each range feeds its own part, then parts get
+        // merged back into the command in height order. A part calling stop() only ends its range
+        virtual Callback              *fork(                            ) const { return 0;     } // Overload to return a part with blank second pass state
+        virtual void                  merge(Callback *part             )       {               } // Fold a part's second pass state into this one
 
         // Callback for first, shallow parse -- all blocks are seen, including orphaned ones but aren't parsed
         virtual void     startMap(const uint8_t *p                     )       {               }  // Called when a blockchain file is mapped into memory
@@ -69,7 +97,24 @@
         )
         {
         }
+
+        // Runs the second pass, or one height range of it. These call every hook through the vtable
+        virtual void parseChain();
+        virtual void parseRange(const Block *first, const Block *last);
     };
 
+    // Derive commands from this rather than straight from Callback: the second
+    // pass is then compiled for the command's own type, and calls its hooks
+    // directly. A command overriding only the first pass startBlock or endBlock
+    // hides the second pass one: add "using Callback::startBlock;" and the like
+    template<typename T> struct Command:public Callback
+    {
+        virtual void parseChain();
+        virtual void parseRange(const Block *first, const Block *last);
+    };
+
+    // Second pass templates, which Command<T> needs to get instantiated
+    #include <chainParser.h>
+
 #endif // __CALLBACK_H__
 
@@ -8,6 +8,7 @@
 #include <rmd160.h>
 #include <sha256.h>
 #include <callback.h>
+#include <memStats.h>
 
 #include <vector>
 #include <string.h>
@@ -38,9 +39,7 @@ struct Addr
     OutputVec *outputVec;
 };
 
-template<> uint8_t *PagedAllocator<Addr>::pool = 0;
-template<> uint8_t *PagedAllocator<Addr>::poolEnd = 0;
-static inline Addr *allocAddr() { return (Addr*)PagedAllocator<Addr>::alloc(); }
+static inline Addr *allocAddr() { return (Addr*)threadArena().alloc(sizeof(Addr)); }
 
 struct CompareAddr
 {
@@ -53,7 +52,7 @@ struct CompareAddr
     }
 };
 
-struct AllBalances:public Callback
+struct AllBalances:public Command<AllBalances>
 {
     bool detailed;
     int64_t limit;
@@ -111,6 +110,16 @@ struct AllBalances:public Callback
     virtual const char                   *name() const         { return "allBalances"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;       }
     virtual bool                         needTXHash() const    { return true;          }
+    virtual uint32_t                     events() const        { return kOutputEvents | kEdgeEvents; }
+
+    virtual void memStats(
+        MemStats &stats
+    ) const
+    {
+        stats.addMap("addrMap", addrMap);
+        stats.addMap("restrictMap", restrictMap);
+        stats.addVector("allAddrs", allAddrs);
+    }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -373,7 +382,6 @@ struct AllBalances:public Callback
         info("found %" PRIu64 " addresses in total", (uint64_t)allAddrs.size());
         info("shown:%" PRIu64 " addresses", (uint64_t)i);
         printf("\n");
-        exit(0);
     }
 
     virtual void start(
@@ -436,7 +444,7 @@ struct AllBalances:public Callback
         blockTime = bTime;
 
         if(0<=cutoffBlock && cutoffBlock<=curBlock->height) {
-            wrapup();
+            stop();
         }
     }
 
@@ -65,7 +65,7 @@ long from_counter(const std::string& value) {
     }
     return xx.v;
 }
-struct CassandraSync:public Callback
+struct CassandraSync:public Command<CassandraSync>
 {
     optparse::OptionParser parser;
 
@@ -394,9 +394,9 @@ struct CassandraSync:public Callback
     virtual void add_block() {
 
        std::string POS = proofOfStake ? "true" : "false";
-       uint8_t *strprevBlkHash = allocHash256(); 
-       uint8_t *strblkMerkleRoot = allocHash256();
-       uint8_t *strblockHash = allocHash256();
+       uint8_t *strprevBlkHash = (uint8_t*)blockArena().alloc(2*kSHA256ByteSize+1);
+       uint8_t *strblkMerkleRoot = (uint8_t*)blockArena().alloc(2*kSHA256ByteSize+1);
+       uint8_t *strblockHash = (uint8_t*)blockArena().alloc(2*kSHA256ByteSize+1);
        toHex(strprevBlkHash,prevBlkHash);
        toHex(strblkMerkleRoot,blkMerkleRoot);
        toHex(strblockHash, blockHash);
@@ -514,7 +514,7 @@ struct CassandraSync:public Callback
     )
     {
         const uint8_t *p = b->data;
-        blockHash = allocHash256();
+        blockHash = (uint8_t*)blockArena().alloc(kSHA256ByteSize);
         sha256Twice(blockHash, p, 80); 
         SKIP(uint32_t, version, p);
         prevBlkHash = p;
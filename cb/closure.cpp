@@ -7,6 +7,7 @@
 #include <option.h>
 #include <rmd160.h>
 #include <callback.h>
+#include <memStats.h>
 
 #include <vector>
 #include <string.h>
@@ -18,7 +19,7 @@ static uint8_t gEmptyKey[kRIPEMD160ByteSize] = { 0x52 };
 typedef GoogMap<Hash160, uint64_t, Hash160Hasher, Hash160Equal >::Map AddrMap;
 typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS> Graph;
 
-struct Closure:public Callback
+struct Closure:public Command<Closure>
 {
     optparse::OptionParser parser;
 
@@ -42,6 +43,23 @@ struct Closure:public Callback
     virtual const char                   *name() const         { return "closure"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;   }
     virtual bool                         needTXHash() const    { return true;      }
+    virtual uint32_t                     events() const        { return kTXEvents | kEdgeEvents; }
+
+    // The graph's own layout isn't exposed: count a vector per vertex, and
+    // per edge a list node plus an entry in each end's edge vector
+    virtual void memStats(
+        MemStats &stats
+    ) const
+    {
+        uint64_t nbVertices = boost::num_vertices(graph);
+        uint64_t nbEdges = boost::num_edges(graph);
+        uint64_t graphSize = nbVertices*32 + nbEdges*64;
+
+        stats.addMap("addrMap", addrMap);
+        stats.addVector("allAddrs", allAddrs);
+        stats.addVector("vertices", vertices);
+        stats.add("graph", graphSize, graphSize, nbEdges);
+    }
 
     virtual void aliases(
         std::vector<const char*> &v
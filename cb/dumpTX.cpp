@@ -9,7 +9,7 @@
 
 typedef GoogMap<Hash256, int, Hash256Hasher, Hash256Equal >::Map TxMap;
 
-struct DumpTX:public Callback
+struct DumpTX:public Command<DumpTX>
 {
     optparse::OptionParser parser;
 
@@ -378,7 +378,7 @@ struct DumpTX:public Callback
         }
 
         if(nbDumped==txMap.size()) {
-            exit(0);
+            stop();
         }
     }
 };
@@ -0,0 +1,213 @@
+// Benchmark the parser's TX hash table against dense and sparse hash maps
+
+#include <util.h>
+#include <string.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+#include <hashTable.h>
+#include <hugePages.h>
+
+#include <vector>
+#include <google/dense_hash_map>
+#include <google/sparse_hash_map>
+
+typedef HashTable<const uint8_t*, kSHA256ByteSize> BenchTable;
+typedef google::dense_hash_map<Hash256, const uint8_t*, Hash256Hasher, Hash256Equal> BenchDense;
+typedef google::sparse_hash_map<Hash256, const uint8_t*, Hash256Hasher, Hash256Equal> BenchSparse;
+
+struct HashBench:public Command<HashBench>
+{
+    optparse::OptionParser parser;
+
+    int nbRuns;
+    bool presize;
+    const uint8_t *currTXHash;
+    std::vector<uint256_t> keys;                // One key per operation, in parse order
+    std::vector<bool> inserts;                  // True if operation is an insert, false if a lookup
+    uint64_t nbInserts;
+
+    HashBench()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description(
+                "record the TX map inserts and lookups the parser does while resolving inputs, "
+                "then replay them against the parser's hash table, on huge pages and on regular ones, "
+                "dense_hash_map and sparse_hash_map"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-n", "--nbRuns")
+            .action("store")
+            .type("int")
+            .set_default(3)
+            .help("replay the trace N times on each table, keep the fastest (default: N=%default)")
+        ;
+        parser
+            .add_option("-p", "--presize")
+            .action("store_true")
+            .set_default(false)
+            .help("size tables for all inserts up front, as the parser does")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "hashBench"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;     }
+    virtual bool                         needTXHash() const    { return true;        }
+    virtual uint32_t                     events() const        { return kTXEvents | kInputEvents | kEdgeEvents; }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        nbRuns = values.get("nbRuns");
+        presize = values.get("presize");
+        if(nbRuns<1) nbRuns = 1;
+
+        nbInserts = 0;
+        info("recording TX map trace");
+        return 0;
+    }
+
+    void record(
+        const uint8_t *hash,
+        bool          insert
+    )
+    {
+        uint256_t key;
+        memcpy(key.v, hash, kSHA256ByteSize);
+        keys.push_back(key);
+        inserts.push_back(insert);
+        if(insert) ++nbInserts;
+    }
+
+    virtual void startTX(
+        const uint8_t *p,
+        const uint8_t *hash
+    )
+    {
+        currTXHash = hash;
+    }
+
+    // The parser adds a TX to its map right after the TX's inputs are resolved
+    virtual void endInputs(
+        const uint8_t *p
+    )
+    {
+        record(currTXHash, true);
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        record(upTXHash, false);
+    }
+
+    // Lookups go through a copy of the key, as parseInput looks up the hash
+    // stored in the spending input rather than the one held by the map
+    template<typename Map> double replay(
+        Map &map
+    )
+    {
+        std::vector<uint256_t> lookups(keys);
+        const uint256_t *k = &keys[0];
+        const uint256_t *l = &lookups[0];
+        uint64_t nbMisses = 0;
+
+        double start = usecs();
+
+            for(size_t i=0; i<keys.size(); ++i) {
+                if(inserts[i]) {
+                    map[k[i].v] = k[i].v;
+                } else {
+                    auto j = map.find(l[i].v);
+                    if(unlikely(map.end()==j)) ++nbMisses;
+                }
+            }
+
+        double elapsed = usecs() - start;
+        if(0<nbMisses) warning("%" PRIu64 " lookups missed", nbMisses);
+        return elapsed;
+    }
+
+    void show(
+        const char *name,
+        double     elapsed
+    )
+    {
+        printf(
+            "    %-16s %10.3f ms %8.1f ns/op\n",
+            name,
+            elapsed*1e-3,
+            (elapsed*1e3)/keys.size()
+        );
+    }
+
+    virtual void wrapup()
+    {
+        if(0==keys.size()) return;
+
+        printf("\n");
+        printf("    trace: %" PRIu64 " inserts, %" PRIu64 " lookups\n", nbInserts, (uint64_t)(keys.size() - nbInserts));
+        printf("\n");
+
+        static uint8_t empty[kSHA256ByteSize] = { 0x42 };
+        bool huge = hugePages();
+        double bestTable = 1e300;
+        double bestSmall = 1e300;
+        double bestDense = 1e300;
+        double bestSparse = 1e300;
+        for(int run=0; run<nbRuns; ++run) {
+
+            BenchTable table;
+            if(presize) table.resize(nbInserts);
+            double t = replay(table);
+            if(t<bestTable) bestTable = t;
+
+            // Same table on regular pages
+            setHugePages(false);
+            {
+                BenchTable small;
+                if(presize) small.resize(nbInserts);
+                t = replay(small);
+                if(t<bestSmall) bestSmall = t;
+            }
+            setHugePages(huge);
+
+            BenchDense dense;
+            dense.set_empty_key(empty);
+            if(presize) dense.resize(nbInserts);
+            t = replay(dense);
+            if(t<bestDense) bestDense = t;
+
+            BenchSparse sparse;
+            if(presize) sparse.resize(nbInserts);
+            t = replay(sparse);
+            if(t<bestSparse) bestSparse = t;
+        }
+
+        show(huge ? "hashTable/2MB" : "hashTable", bestTable);
+        show("hashTable/4KB", bestSmall);
+        show("dense_hash_map", bestDense);
+        show("sparse_hash_map", bestSparse);
+        printf("\n");
+    }
+};
+
+static HashBench hashBench;
+
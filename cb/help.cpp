@@ -5,6 +5,7 @@
 #include <common.h>
 #include <errlog.h>
 #include <option.h>
+#include <parser.h>
 #include <callback.h>
 
 struct Help:public Callback
@@ -74,11 +75,15 @@ struct Help:public Callback
         }
 
         printf("\n");
-        printf("General Usage: parser <command> <options> <command arguments>\n");
+        printf("General Usage: parser [parser options] <command> <options> <command arguments>\n");
         printf("\n");
         printf("    Where <command> can be any of:\n");
         Callback::find("", true);
         printf("\n");
+        printf("    And [parser options] can be any of:\n");
+        printf("\n");
+        printf("%s", parserOptions().format_option_help(6).c_str());
+        printf("\n");
         printf("    NOTE: use \"parser help <command>\" or \"parser <command> --help\" to get detailed\n");
         printf("          help for a specific command.\n");
         printf("\n");
@@ -0,0 +1,114 @@
+// Benchmark the second pass with hooks called directly against hooks called through the vtable
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+
+struct HookBench:public Command<HookBench>
+{
+    optparse::OptionParser parser;
+
+    int nbRuns;
+    uint64_t nbEvents;
+
+    HookBench()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description(
+                "walk the longest chain several times, with the parse loop compiled for this "
+                "command and with hooks called through the vtable, and show the time per event"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-n", "--nbRuns")
+            .action("store")
+            .type("int")
+            .set_default(3)
+            .help("walk the chain N times each way, keep the fastest (default: N=%default)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "hookBench"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;     }
+    virtual bool                         needTXHash() const    { return false;       }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        nbRuns = values.get("nbRuns");
+        if(nbRuns<1) nbRuns = 1;
+        return 0;
+    }
+
+    // As cheap as hooks get, so that the cost of calling them stands out
+    virtual void      startTX(const uint8_t *p, const uint8_t *hash) { ++nbEvents; }
+    virtual void        endTX(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void  startInputs(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void    endInputs(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void   startInput(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void     endInput(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void startOutputs(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void   endOutputs(const uint8_t *p                     ) { ++nbEvents; }
+    virtual void  startOutput(const uint8_t *p                     ) { ++nbEvents; }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        uint64_t      value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        ++nbEvents;
+    }
+
+    // Neither needs TX hashes, so walking the chain again leaves the parser's state alone
+    double direct()
+    {
+        nbEvents = 0;
+        double start = usecs();
+            ChainParser<HookBench>::parseChain(this);
+        return usecs() - start;
+    }
+
+    double throughVTable()
+    {
+        nbEvents = 0;
+        double start = usecs();
+            ChainParser<Callback>::parseChain(this);
+        return usecs() - start;
+    }
+
+    virtual void wrapup()
+    {
+        double bestDirect = 1e300;
+        double bestVirtual = 1e300;
+        for(int run=0; run<nbRuns; ++run) {
+            double t = direct();
+            if(t<bestDirect) bestDirect = t;
+            t = throughVTable();
+            if(t<bestVirtual) bestVirtual = t;
+        }
+        if(0==nbEvents) return;
+
+        printf("\n");
+        printf("    %" PRIu64 " hook calls per walk\n", nbEvents);
+        printf("\n");
+        printf("    direct     %10.3f ms %6.2f ns/event\n", bestDirect*1e-3, (bestDirect*1e3)/nbEvents);
+        printf("    vtable     %10.3f ms %6.2f ns/event\n", bestVirtual*1e-3, (bestVirtual*1e3)/nbEvents);
+        printf("    saved      %10.3f ms %6.2f ns/event\n", (bestVirtual - bestDirect)*1e-3, ((bestVirtual - bestDirect)*1e3)/nbEvents);
+        printf("\n");
+    }
+};
+
+static HookBench hookBench;
+
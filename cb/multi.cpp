@@ -0,0 +1,443 @@
+// Run several commands off a single parse of the chain, each on its own thread
+
+#include <ring.h>
+#include <util.h>
+#include <arena.h>
+#include <string.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+#include <memStats.h>
+
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+enum {
+    kStart,
+    kStartBlock,
+    kEndBlock,
+    kStartTX,
+    kEndTX,
+    kStartInputs,
+    kEndInputs,
+    kStartInput,
+    kEndInput,
+    kStartOutputs,
+    kEndOutputs,
+    kStartOutput,
+    kEndOutput,
+    kEdge,
+    kDone
+};
+
+// One second pass hook call, with its arguments
+struct HookEvent
+{
+    uint32_t      kind;
+    const Block   *block;                   // start (first block), startBlock, endBlock
+    const Block   *lastBlock;               // start
+    const uint8_t *p;                       // Raw data the hook points at, input script for edge
+    const uint8_t *hash;                    // TX hash, upstream TX hash for edge
+    const uint8_t *script;                  // Output script
+    uint64_t      scriptSize;
+    uint64_t      value;                    // Output value, chain size for startBlock
+    uint64_t      index;                    // Output index
+    const uint8_t *downHash;                // Downstream TX hash for edge
+    uint64_t      inputIndex;
+    uint64_t      inputScriptSize;
+};
+
+static const size_t kRingSize = 16384;
+typedef SPSCRing<HookEvent, kRingSize> EventRing;
+
+struct Consumer
+{
+    Callback                 *command;
+    uint32_t                 events;
+    bool                     needTXHash;
+    std::vector<std::string> args;
+    EventRing                ring;
+    boost::thread            *thread;
+    volatile bool            stopped;           // Command asked to stop, and gets no more events
+};
+
+struct Multi:public Command<Multi>
+{
+    optparse::OptionParser parser;
+
+    bool started;
+    uint32_t allEvents;
+    bool anyNeedTXHash;
+    std::vector<Consumer*> consumers;
+
+    Multi()
+    {
+        parser
+            .usage("\"<command> [command options]\" ...")
+            .version("")
+            .description(
+                "parse the chain once and feed it to several commands, each running on its own "
+                "thread. Quote commands that take options or arguments, as in: "
+                "parser multi \"balances -a 100000\" stats rewards. Commands wrap up one after "
+                "the other, in command line order"
+            )
+            .epilog("")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "multi";       }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;       }
+    virtual bool                         needTXHash() const    { return anyNeedTXHash; }
+    virtual uint32_t                     events() const        { return allEvents;     }
+    virtual bool                         asyncEvents() const   { return true;          }
+
+    // Each command reports under its own name, next to its event ring. Memory
+    // reports are taken on the parse thread between blocks: rings get drained
+    // first, so that no command runs a hook while its structures get measured
+    virtual void memStats(
+        MemStats &stats
+    ) const
+    {
+        if(started) {
+            for(size_t i=0; i<consumers.size(); ++i) consumers[i]->ring.drain();
+        }
+
+        std::string owner = stats.owner;
+        for(size_t i=0; i<consumers.size(); ++i) {
+            const Consumer *c = consumers[i];
+            stats.owner = c->command->name();
+            stats.add("ring", kRingSize*sizeof(HookEvent), kRingSize*sizeof(HookEvent), kRingSize);
+            c->command->memStats(stats);
+        }
+        stats.owner = owner;
+    }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        started = false;
+        allEvents = kBlockEvents;
+        anyNeedTXHash = false;
+
+        parser.parse_args(argc, argv);
+        auto args = parser.args();
+        if(args.size()<2) errFatal("multi: no command given");
+
+        for(size_t i=1; i<args.size(); ++i) {
+
+            Consumer *c = new Consumer;
+            c->thread = 0;
+            c->stopped = false;
+
+            // Command line of this command, split on blanks
+            const char *s = args[i].c_str();
+            while(*s) {
+                while(' '==*s || '\t'==*s) ++s;
+                const char *start = s;
+                while(*s && ' '!=*s && '\t'!=*s) ++s;
+                if(start<s) c->args.push_back(std::string(start, s));
+            }
+            if(0==c->args.size()) continue;
+
+            c->command = Callback::find(c->args[0].c_str());
+            if(0==strcmp("help", c->command->name())) errFatal("multi: can't run help");
+            if(this==c->command) errFatal("multi: can't run multi");
+            for(size_t j=0; j<consumers.size(); ++j) {
+                if(consumers[j]->command==c->command) {
+                    errFatal("multi: command \"%s\" given twice", c->command->name());
+                }
+            }
+
+            std::vector<const char*> commandArgv;
+            commandArgv.push_back(argv[0]);
+            for(size_t j=0; j<c->args.size(); ++j) commandArgv.push_back(c->args[j].c_str());
+            commandArgv.push_back(0);
+
+            info("multi: starting command \"%s\"", c->command->name());
+            int r = c->command->init(commandArgv.size() - 1, &commandArgv[0]);
+            if(r<0) errFatal("multi: init of command \"%s\" failed", c->command->name());
+
+            // Run alone, a command that needs no TX hashes gets no edges
+            // either: it gets none here, whatever the others ask for
+            c->events = kBlockEvents | c->command->events();
+            c->needTXHash = c->command->needTXHash();
+            if(!c->needTXHash) c->events &= ~kEdgeEvents;
+            allEvents |= c->events;
+            anyNeedTXHash = anyNeedTXHash || c->needTXHash;
+            consumers.push_back(c);
+        }
+        return 0;
+    }
+
+    // Send an event to every command that subscribed to it and hasn't stopped.
+    // Commands that need no TX hashes see null ones, as they would alone
+    void post(
+        uint32_t        mask,
+        const HookEvent &event
+    )
+    {
+        auto e = consumers.end();
+        auto i = consumers.begin();
+        while(i!=e) {
+            Consumer *c = *(i++);
+            if(0==(c->events & mask) || c->stopped) continue;
+
+            HookEvent *slot = c->ring.claim();
+            *slot = event;
+            if(!c->needTXHash) {
+                slot->hash = 0;
+                slot->downHash = 0;
+            }
+            c->ring.commit();
+        }
+    }
+
+    static void dispatch(
+        Callback        *command,
+        const HookEvent &e
+    )
+    {
+        switch(e.kind) {
+            case kStart:        command->start(e.block, e.lastBlock);       break;
+            case kStartBlock:   command->startBlock(e.block, e.value);      break;
+            case kEndBlock:     command->endBlock(e.block);                 break;
+            case kStartTX:      command->startTX(e.p, e.hash);              break;
+            case kEndTX:        command->endTX(e.p);                        break;
+            case kStartInputs:  command->startInputs(e.p);                  break;
+            case kEndInputs:    command->endInputs(e.p);                    break;
+            case kStartInput:   command->startInput(e.p);                   break;
+            case kEndInput:     command->endInput(e.p);                     break;
+            case kStartOutputs: command->startOutputs(e.p);                 break;
+            case kEndOutputs:   command->endOutputs(e.p);                   break;
+            case kStartOutput:  command->startOutput(e.p);                  break;
+            case kEndOutput:
+                command->endOutput(
+                    e.p,
+                    e.value,
+                    e.hash,
+                    e.index,
+                    e.script,
+                    e.scriptSize
+                );
+                break;
+            case kEdge:
+                command->edge(
+                    e.value,
+                    e.hash,
+                    e.index,
+                    e.script,
+                    e.scriptSize,
+                    e.downHash,
+                    e.inputIndex,
+                    e.p,
+                    e.inputScriptSize
+                );
+                break;
+        }
+    }
+
+    // A command that stops from startBlock gets nothing more, else it gets
+    // the rest of the block, as it would running on its own
+    static void consume(
+        Consumer *c
+    )
+    {
+        bool dropping = false;
+        while(1) {
+
+            const HookEvent *e = c->ring.next();
+            if(unlikely(kDone==e->kind)) {
+                c->ring.pop();
+                break;
+            }
+
+            // Per block buffers the command takes come from this thread's arena
+            if(kStartBlock==e->kind) blockArena().reset();
+
+            if(likely(!dropping)) {
+                dispatch(c->command, *e);
+                if(unlikely(c->command->stopRequested)) {
+                    dropping = (kStartBlock==e->kind || kEndBlock==e->kind);
+                    if(dropping) c->stopped = true;
+                }
+            }
+            c->ring.pop();
+        }
+    }
+
+    virtual void startMap(const uint8_t *p)
+    {
+        for(size_t i=0; i<consumers.size(); ++i) consumers[i]->command->startMap(p);
+    }
+
+    virtual void endMap(const uint8_t *p)
+    {
+        for(size_t i=0; i<consumers.size(); ++i) consumers[i]->command->endMap(p);
+    }
+
+    virtual void startBlock(const uint8_t *p)
+    {
+        for(size_t i=0; i<consumers.size(); ++i) consumers[i]->command->startBlock(p);
+    }
+
+    virtual void endBlock(const uint8_t *p)
+    {
+        for(size_t i=0; i<consumers.size(); ++i) consumers[i]->command->endBlock(p);
+    }
+
+    virtual void start(
+        const Block *s,
+        const Block *e
+    )
+    {
+        for(size_t i=0; i<consumers.size(); ++i) {
+            consumers[i]->thread = new boost::thread(consume, consumers[i]);
+        }
+        started = true;
+
+        HookEvent event;
+        event.kind = kStart;
+        event.block = s;
+        event.lastBlock = e;
+        post(kBlockEvents, event);
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t    chainSize
+    )
+    {
+        // The parse only stops once every command has
+        bool allStopped = true;
+        for(size_t i=0; i<consumers.size(); ++i) allStopped = allStopped && consumers[i]->stopped;
+        if(unlikely(allStopped)) {
+            stop();
+            return;
+        }
+
+        HookEvent event;
+        event.kind = kStartBlock;
+        event.block = b;
+        event.value = chainSize;
+        post(kBlockEvents, event);
+    }
+
+    virtual void endBlock(
+        const Block *b
+    )
+    {
+        HookEvent event;
+        event.kind = kEndBlock;
+        event.block = b;
+        post(kBlockEvents, event);
+        for(size_t i=0; i<consumers.size(); ++i) consumers[i]->ring.flush();
+    }
+
+    virtual void startTX(
+        const uint8_t *p,
+        const uint8_t *hash
+    )
+    {
+        HookEvent event;
+        event.kind = kStartTX;
+        event.p = p;
+        event.hash = hash;
+        post(kTXEvents, event);
+    }
+
+    void postP(
+        uint32_t      mask,
+        uint32_t      kind,
+        const uint8_t *p
+    )
+    {
+        HookEvent event;
+        event.kind = kind;
+        event.p = p;
+        post(mask, event);
+    }
+
+    virtual void        endTX(const uint8_t *p) { postP(kTXEvents,     kEndTX,        p); }
+    virtual void  startInputs(const uint8_t *p) { postP(kInputEvents,  kStartInputs,  p); }
+    virtual void    endInputs(const uint8_t *p) { postP(kInputEvents,  kEndInputs,    p); }
+    virtual void   startInput(const uint8_t *p) { postP(kInputEvents,  kStartInput,   p); }
+    virtual void     endInput(const uint8_t *p) { postP(kInputEvents,  kEndInput,     p); }
+    virtual void startOutputs(const uint8_t *p) { postP(kOutputEvents, kStartOutputs, p); }
+    virtual void   endOutputs(const uint8_t *p) { postP(kOutputEvents, kEndOutputs,   p); }
+    virtual void  startOutput(const uint8_t *p) { postP(kOutputEvents, kStartOutput,  p); }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        uint64_t      value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        HookEvent event;
+        event.kind = kEndOutput;
+        event.p = p;
+        event.value = value;
+        event.hash = txHash;
+        event.index = outputIndex;
+        event.script = outputScript;
+        event.scriptSize = outputScriptSize;
+        post(kOutputEvents, event);
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        HookEvent event;
+        event.kind = kEdge;
+        event.value = value;
+        event.hash = upTXHash;
+        event.index = outputIndex;
+        event.script = outputScript;
+        event.scriptSize = outputScriptSize;
+        event.downHash = downTXHash;
+        event.inputIndex = inputIndex;
+        event.p = inputScript;
+        event.inputScriptSize = inputScriptSize;
+        post(kEdgeEvents, event);
+    }
+
+    virtual void wrapup()
+    {
+        if(started) {
+            for(size_t i=0; i<consumers.size(); ++i) {
+                Consumer *c = consumers[i];
+                c->ring.claim()->kind = kDone;
+                c->ring.commit();
+                c->ring.flush();
+            }
+            for(size_t i=0; i<consumers.size(); ++i) {
+                consumers[i]->thread->join();
+                delete consumers[i]->thread;
+            }
+            started = false;
+        }
+
+        for(size_t i=0; i<consumers.size(); ++i) {
+            info("multi: wrapping up command \"%s\"", consumers[i]->command->name());
+            consumers[i]->command->wrapup();
+        }
+    }
+};
+
+static Multi multi;
+
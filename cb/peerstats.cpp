@@ -9,7 +9,7 @@
 #include <callback.h>
 #include <ctime>
 
-struct PeerStats:public Callback
+struct PeerStats:public Command<PeerStats>
 {
     optparse::OptionParser parser;
 
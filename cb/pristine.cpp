@@ -10,7 +10,7 @@
 
 typedef GoogMap<Hash256, uint64_t, Hash256Hasher, Hash256Equal >::Map TxMap;
 
-struct Pristine:public Callback
+struct Pristine:public Command<Pristine>
 {
     optparse::OptionParser parser;
 
@@ -35,6 +35,7 @@ struct Pristine:public Callback
     virtual const char                   *name() const         { return "pristine"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;    }
     virtual bool                         needTXHash() const    { return true;       }
+    virtual uint32_t                     events() const        { return kTXEvents | kInputEvents | kEdgeEvents; }
 
     virtual int init(
         int argc,
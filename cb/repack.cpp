@@ -0,0 +1,203 @@
+
+// Write the longest chain out in height order, orphans left out, along
+// with the block index that lets "parser --packed" skip the first pass
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <parser.h>
+#include <callback.h>
+#include <blockIndex.h>
+
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct Repack:public Command<Repack>
+{
+    optparse::OptionParser parser;
+
+    uint64_t                     maxFileSize;
+    FILE                         *file;
+    std::string                  dir;
+    std::vector<BlockIndexFile>  files;
+    std::vector<BlockIndexEntry> entries;
+
+    Repack()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description(
+                "write the longest chain to ~/.SonicScrewdriver/packed, in height order and "
+                "without orphans, for later runs of \"parser --packed <command>\" to read"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-s", "--fileSize")
+            .action("store")
+            .type("int")
+            .set_default(128)
+            .help("start a new pack file once one holds <n> MB (default: n=%default)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "repack"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;  }
+    virtual bool                         needTXHash() const    { return false;    }
+    virtual uint32_t                     events() const        { return 0;        }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        int fileSize = values.get("fileSize");
+        maxFileSize = ((uint64_t)(fileSize<1 ? 1 : fileSize))<<20;
+        file = 0;
+        return 0;
+    }
+
+    std::string packName(
+        size_t i
+    )
+    {
+        char buf[64];
+        sprintf(buf, "pack%05d.dat", (int)i);
+        return dir + std::string(buf);
+    }
+
+    // Pack files only show up under their name once all of them are written:
+    // a --packed run may be reading the previous ones right now
+    void nextFile()
+    {
+        if(file && 0!=fclose(file)) sysErrFatal("failed to write %s.tmp", packName(files.size() - 1).c_str());
+
+        BlockIndexFile f;
+        memset(&f, 0, sizeof(f));
+        files.push_back(f);
+
+        std::string tmpName = packName(files.size() - 1) + ".tmp";
+        file = fopen(tmpName.c_str(), "wb");
+        if(!file) sysErrFatal("failed to create %s", tmpName.c_str());
+    }
+
+    virtual void start(
+        const Block *s,
+        const Block *e
+    )
+    {
+        dir = packDir();
+        int r = mkdir(dir.c_str(), 0755);
+        if(r<0 && EEXIST!=errno) sysErrFatal("failed to create %s", dir.c_str());
+        info("repacking the longest chain to %s", dir.c_str());
+    }
+
+    // Blocks go out framed by their magic and size, just as in blk files
+    virtual void startBlock(
+        const Block *b,
+        uint64_t    chainSize
+    )
+    {
+        uint32_t size;
+        memcpy(&size, b->data - 4, sizeof(size));
+
+        uint64_t frameSize = 8 + (uint64_t)size;
+        bool full = (0<files.size() && maxFileSize<files.back().size + frameSize);
+        if(0==file || (full && 0<files.back().nbBlocks)) nextFile();
+
+        BlockIndexFile &f = files.back();
+        if(1!=fwrite(b->data - 8, frameSize, 1, file)) sysErrFatal("failed to write %s.tmp", packName(files.size() - 1).c_str());
+
+        BlockIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        sha256Twice(entry.hash.v, b->data, 80);
+        entry.fileId = files.size() - 1;
+        entry.size = size;
+        entry.offset = f.size + 8;
+        entry.height = b->height;
+        entry.prev = entries.empty() ? (int64_t)BlockIndex::kNullBlockRef : (int64_t)entries.size() - 1;
+        entry.next = BlockIndex::kNoBlockRef;
+        if(!entries.empty()) entries.back().next = entries.size();
+        entries.push_back(entry);
+
+        f.size += frameSize;
+        f.scanEnd = f.size;
+        ++f.nbBlocks;
+    }
+
+    // Whatever sat in the pack directory went with the previous layout
+    void removeStale()
+    {
+        for(size_t i=0; ; ++i) {
+            std::string name = packName(i);
+            int r0 = (i<files.size()) ? 0 : unlink(name.c_str());
+            int r1 = unlink((name + ".zst").c_str());
+            if(files.size()<=i && r0<0 && r1<0) break;
+        }
+
+        DIR *d = opendir(dir.c_str());
+        if(0==d) return;
+
+        static const char prefix[] = "blockparser.";
+        while(1) {
+            struct dirent *entry = readdir(d);
+            if(0==entry) break;
+            if(0==strncmp(entry->d_name, prefix, sizeof(prefix) - 1)) {
+                unlink((dir + std::string(entry->d_name)).c_str());
+            }
+        }
+        closedir(d);
+    }
+
+    virtual void wrapup()
+    {
+        if(0==file) {
+            warning("repack: no block to write");
+            return;
+        }
+        if(0!=fclose(file)) sysErrFatal("failed to write %s.tmp", packName(files.size() - 1).c_str());
+        file = 0;
+
+        removeStale();
+
+        // The parser tells unchanged pack files by size and mtime
+        for(size_t i=0; i<files.size(); ++i) {
+
+            std::string name = packName(i);
+            std::string tmpName = name + ".tmp";
+            int r = rename(tmpName.c_str(), name.c_str());
+            if(r<0) sysErrFatal("failed to rename %s", tmpName.c_str());
+
+            struct stat statBuf;
+            r = stat(name.c_str(), &statBuf);
+            if(r<0) sysErrFatal("failed to stat %s", name.c_str());
+            files[i].mtime = statBuf.st_mtim.tv_sec*1000000000LL + statBuf.st_mtim.tv_nsec;
+        }
+
+        bool ok = BlockIndex::save(
+            dir + std::string("blockparser.idx"),
+            files,
+            entries,
+            entries.size() - 1
+        );
+        if(!ok) errFatal("repack: failed to write the block index");
+
+        info(
+            "repack: %" PRIu64 " blocks in %" PRIu64 " files",
+            (uint64_t)entries.size(),
+            (uint64_t)files.size()
+        );
+    }
+};
+
+static Repack repack;
+
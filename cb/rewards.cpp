@@ -9,7 +9,7 @@
 #include <callback.h>
 #include <ctime>
 
-struct Rewards:public Callback
+struct Rewards:public Command<Rewards>
 {
     optparse::OptionParser parser;
 
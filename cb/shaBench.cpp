@@ -0,0 +1,300 @@
+// Benchmark the SHA-256d engines against OpenSSL on the chain's own headers and TXs
+
+#include <util.h>
+#include <string.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+
+#include <vector>
+#include <openssl/sha.h>
+
+struct SHABench:public Command<SHABench>
+{
+    optparse::OptionParser parser;
+
+    int nbRuns;
+    const uint8_t *txStart;
+    std::vector<const uint8_t*> headers;
+    std::vector<size_t> headerSizes;
+    std::vector<const uint8_t*> txs;
+    std::vector<size_t> txSizes;
+    std::vector<size_t> blockStarts;            // Index in txs of the first TX of each block
+    uint64_t nbTXBytes;
+
+    SHABench()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description(
+                "hash all block headers and TXs of the longest chain with every SHA-256d engine "
+                "the CPU supports, one at a time and batched per block, and with OpenSSL"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-n", "--nbRuns")
+            .action("store")
+            .type("int")
+            .set_default(3)
+            .help("hash everything N times with each engine, keep the fastest (default: N=%default)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "shaBench"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;    }
+    virtual bool                         needTXHash() const    { return false;      }
+    virtual uint32_t                     events() const        { return kTXEvents; }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        nbRuns = values.get("nbRuns");
+        if(nbRuns<1) nbRuns = 1;
+
+        nbTXBytes = 0;
+        info("collecting headers and transactions");
+        return 0;
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t
+    )
+    {
+        headers.push_back(b->data);
+        headerSizes.push_back(80);
+        blockStarts.push_back(txs.size());
+    }
+
+    virtual void startTX(
+        const uint8_t *p,
+        const uint8_t *hash
+    )
+    {
+        txStart = p;
+    }
+
+    virtual void endTX(
+        const uint8_t *p
+    )
+    {
+        txs.push_back(txStart);
+        txSizes.push_back(p - txStart);
+        nbTXBytes += p - txStart;
+    }
+
+    static void openSSL(
+        uint8_t       *result,
+        const uint8_t *data,
+        size_t        len
+    )
+    {
+        uint8_t first[kSHA256ByteSize];
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, data, len);
+        SHA256_Final(first, &ctx);
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, first, kSHA256ByteSize);
+        SHA256_Final(result, &ctx);
+    }
+
+    double oneByOne(
+        const std::vector<const uint8_t*> &data,
+        const std::vector<size_t>         &sizes,
+        bool                              useOpenSSL
+    )
+    {
+        uint8_t result[kSHA256ByteSize];
+        double start = usecs();
+            for(size_t i=0; i<data.size(); ++i) {
+                if(useOpenSSL) openSSL(result, data[i], sizes[i]);
+                else           sha256d(result, data[i], sizes[i]);
+            }
+        return usecs() - start;
+    }
+
+    // TXs go to the engine one block at a time, as the parser feeds them;
+    // headers in runs of 1024, as the first pass does per blk file
+    double batched(
+        const std::vector<const uint8_t*> &data,
+        const std::vector<size_t>         &sizes,
+        const std::vector<size_t>         &starts
+    )
+    {
+        std::vector<uint8_t> out(data.size()*kSHA256ByteSize);
+        std::vector<uint8_t*> results(data.size());
+        for(size_t i=0; i<data.size(); ++i) results[i] = i*kSHA256ByteSize + &out[0];
+
+        double start = usecs();
+            for(size_t b=0; b<starts.size(); ++b) {
+                size_t first = starts[b];
+                size_t last = (b+1<starts.size()) ? starts[b+1] : data.size();
+                if(first<last) sha256dBatch(&results[first], &data[first], &sizes[first], last - first);
+            }
+        return usecs() - start;
+    }
+
+    // What the current engine yields for all of data, one by one or batched
+    // as batched() feeds it
+    static void digests(
+        std::vector<uint8_t>              &out,
+        const std::vector<const uint8_t*> &data,
+        const std::vector<size_t>         &sizes,
+        const std::vector<size_t>         &starts,
+        bool                              batch
+    )
+    {
+        out.resize(data.size()*kSHA256ByteSize);
+        std::vector<uint8_t*> results(data.size());
+        for(size_t i=0; i<data.size(); ++i) results[i] = i*kSHA256ByteSize + &out[0];
+
+        if(!batch) {
+            for(size_t i=0; i<data.size(); ++i) sha256d(results[i], data[i], sizes[i]);
+            return;
+        }
+
+        for(size_t b=0; b<starts.size(); ++b) {
+            size_t first = starts[b];
+            size_t last = (b+1<starts.size()) ? starts[b+1] : data.size();
+            if(first<last) sha256dBatch(&results[first], &data[first], &sizes[first], last - first);
+        }
+    }
+
+    static void check(
+        const char                        *engine,
+        const char                        *what,
+        const std::vector<const uint8_t*> &data,
+        const std::vector<size_t>         &sizes,
+        const std::vector<size_t>         &starts,
+        const std::vector<uint8_t>        &expected
+    )
+    {
+        std::vector<uint8_t> out;
+        for(int batch=0; batch<2; ++batch) {
+            digests(out, data, sizes, starts, 0!=batch);
+            for(size_t i=0; i<data.size(); ++i) {
+                const uint8_t *a = i*kSHA256ByteSize + &out[0];
+                const uint8_t *b = i*kSHA256ByteSize + &expected[0];
+                if(0!=memcmp(a, b, kSHA256ByteSize)) {
+                    errFatal(
+                        "shaBench: engine \"%s\" (%s) disagrees with OpenSSL on %s #%" PRIu64,
+                        engine,
+                        batch ? "batched" : "single",
+                        what,
+                        (uint64_t)i
+                    );
+                }
+            }
+        }
+    }
+
+    // A broken engine would only look fast: every engine the CPU supports
+    // must match OpenSSL on everything before anything gets timed
+    void verify(
+        const char *const         *engines,
+        size_t                    nbEngines,
+        const std::vector<size_t> &headerStarts
+    )
+    {
+        std::vector<uint8_t> headerDigests(headers.size()*kSHA256ByteSize);
+        for(size_t i=0; i<headers.size(); ++i) openSSL(i*kSHA256ByteSize + &headerDigests[0], headers[i], headerSizes[i]);
+
+        std::vector<uint8_t> txDigests(txs.size()*kSHA256ByteSize);
+        for(size_t i=0; i<txs.size(); ++i) openSSL(i*kSHA256ByteSize + &txDigests[0], txs[i], txSizes[i]);
+
+        for(size_t e=0; e<nbEngines; ++e) {
+            if(!sha256SetEngine(engines[e])) continue;
+            check(engines[e], "header", headers, headerSizes, headerStarts, headerDigests);
+            check(engines[e], "TX", txs, txSizes, blockStarts, txDigests);
+        }
+        info("shaBench: all engines agree with OpenSSL");
+    }
+
+    void show(
+        const char *engine,
+        const char *mode,
+        double     headerTime,
+        double     txTime
+    )
+    {
+        printf(
+            "    %-8s %-10s headers: %8.1f ns/header    TXs: %8.1f ns/TX %9.1f MB/s\n",
+            engine,
+            mode,
+            (headerTime*1e3)/headers.size(),
+            (txTime*1e3)/txs.size(),
+            nbTXBytes/txTime
+        );
+    }
+
+    virtual void wrapup()
+    {
+        if(0==txs.size()) return;
+
+        printf("\n");
+        printf(
+            "    %" PRIu64 " headers, %" PRIu64 " TXs, %.1f MB of TX data\n",
+            (uint64_t)headers.size(),
+            (uint64_t)txs.size(),
+            nbTXBytes*1e-6
+        );
+        printf("\n");
+
+        std::vector<size_t> headerStarts;
+        for(size_t i=0; i<headers.size(); i+=1024) headerStarts.push_back(i);
+
+        std::string current(sha256Engine());
+        static const char *engines[] = { "scalar", "sse4", "avx2", "shani" };
+        static const size_t nbEngines = sizeof(engines)/sizeof(engines[0]);
+        verify(engines, nbEngines, headerStarts);
+        sha256SetEngine(current.c_str());
+
+        double bestHeaders = 1e300;
+        double bestTXs = 1e300;
+        for(int run=0; run<nbRuns; ++run) {
+            double t = oneByOne(headers, headerSizes, true);
+            if(t<bestHeaders) bestHeaders = t;
+            t = oneByOne(txs, txSizes, true);
+            if(t<bestTXs) bestTXs = t;
+        }
+        show("openssl", "single", bestHeaders, bestTXs);
+
+        for(size_t e=0; e<nbEngines; ++e) {
+
+            if(!sha256SetEngine(engines[e])) {
+                printf("    %-8s not supported by this CPU\n", engines[e]);
+                continue;
+            }
+
+            double bestSingleHeaders = 1e300;
+            double bestSingleTXs = 1e300;
+            double bestBatchHeaders = 1e300;
+            double bestBatchTXs = 1e300;
+            for(int run=0; run<nbRuns; ++run) {
+                double t = oneByOne(headers, headerSizes, false);
+                if(t<bestSingleHeaders) bestSingleHeaders = t;
+                t = oneByOne(txs, txSizes, false);
+                if(t<bestSingleTXs) bestSingleTXs = t;
+                t = batched(headers, headerSizes, headerStarts);
+                if(t<bestBatchHeaders) bestBatchHeaders = t;
+                t = batched(txs, txSizes, blockStarts);
+                if(t<bestBatchTXs) bestBatchTXs = t;
+            }
+            show(engines[e], "single", bestSingleHeaders, bestSingleTXs);
+            show(engines[e], "batched", bestBatchHeaders, bestBatchTXs);
+        }
+
+        sha256SetEngine(current.c_str());
+        printf("\n    parser uses engine \"%s\"\n\n", current.c_str());
+    }
+};
+
+static SHABench shaBench;
+
@@ -6,7 +6,7 @@
 #include <option.h>
 #include <callback.h>
 
-struct SimpleStats:public Callback
+struct SimpleStats:public Command<SimpleStats>
 {
     optparse::OptionParser parser;
 
@@ -31,6 +31,7 @@ struct SimpleStats:public Callback
     virtual const char                   *name() const         { return "simpleStats"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;       }
     virtual bool                         needTXHash() const    { return false;         }
+    virtual uint32_t                     events() const        { return kTXEvents | kInputEvents | kOutputEvents; }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -54,6 +55,30 @@ struct SimpleStats:public Callback
         return 0;
     }
 
+    // Second pass counters are plain sums: height ranges may get counted apart
+    virtual Callback *fork() const
+    {
+        SimpleStats *part = new SimpleStats(*this);
+        part->volume = 0;
+        part->nbInputs = 0;
+        part->nbOutputs = 0;
+        part->nbValidBlocks = 0;
+        part->nbTransactions = 0;
+        return part;
+    }
+
+    virtual void merge(
+        Callback *c
+    )
+    {
+        const SimpleStats *part = static_cast<const SimpleStats*>(c);
+        volume += part->volume;
+        nbInputs += part->nbInputs;
+        nbOutputs += part->nbOutputs;
+        nbValidBlocks += part->nbValidBlocks;
+        nbTransactions += part->nbTransactions;
+    }
+
     virtual void endOutput(
         const uint8_t *p,
         uint64_t      value,
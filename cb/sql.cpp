@@ -7,6 +7,7 @@
 #include <errlog.h>
 #include <option.h>
 #include <callback.h>
+#include <memStats.h>
 
 static uint8_t empty[kSHA256ByteSize] = { 0x42 };
 typedef GoogMap<Hash256, uint64_t, Hash256Hasher, Hash256Equal>::Map OutputMap;
@@ -29,7 +30,7 @@ static void writeEscapedBinaryBuffer(
     }
 }
 
-struct SQLDump:public Callback
+struct SQLDump:public Command<SQLDump>
 {
     FILE *txFile;
     FILE *blockFile;
@@ -64,6 +65,14 @@ struct SQLDump:public Callback
     virtual const char                   *name() const         { return "sqldump"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;   }
     virtual bool                         needTXHash() const    { return true;      }
+    virtual uint32_t                     events() const        { return kTXEvents | kOutputEvents | kEdgeEvents; }
+
+    virtual void memStats(
+        MemStats &stats
+    ) const
+    {
+        stats.addMap("outputMap", outputMap);
+    }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -182,7 +191,10 @@ struct SQLDump:public Callback
         uint64_t
     )
     {
-        if(0<=cutoffBlock && cutoffBlock<b->height) wrapup();
+        if(0<=cutoffBlock && cutoffBlock<b->height) {
+            stop();
+            return;
+        }
 
         uint8_t blockHash[kSHA256ByteSize];
         sha256Twice(blockHash, b->data, 80);
@@ -326,7 +338,6 @@ struct SQLDump:public Callback
         fclose(blockFile);
         fclose(txFile);
         info("done\n");
-        exit(0);
     }
 };
 
@@ -20,7 +20,7 @@ typedef GoogMap<Hash256, uint32_t, Hash256Hasher, Hash256Equal>::Map TXTimeMap;
 static uint8_t empty[kSHA256ByteSize] = { 0x42 };
 static int64_t database_last_block;
     
-struct sqliteSync:public Callback
+struct sqliteSync:public Command<sqliteSync>
 {
     optparse::OptionParser parser;
 
@@ -415,7 +415,7 @@ struct sqliteSync:public Callback
     )
     {
         const uint8_t *p = b->data;
-        blockHash = allocHash256();
+        blockHash = (uint8_t*)blockArena().alloc(kSHA256ByteSize);
         sha256Twice(blockHash, p, 80); 
         SKIP(uint32_t, version, p);
         prevBlkHash = p;
@@ -27,6 +27,7 @@
 #include <errlog.h>
 #include <string.h>
 #include <callback.h>
+#include <memStats.h>
 
 typedef long double Number;
 typedef GoogMap<Hash256, int, Hash256Hasher, Hash256Equal >::Map TxMap;
@@ -39,7 +40,7 @@ static inline void printNumber(
     printf("%.32Lf ", x);
 }
 
-struct Taint:public Callback
+struct Taint:public Command<Taint>
 {
     optparse::OptionParser parser;
 
@@ -67,6 +68,15 @@ struct Taint:public Callback
     virtual const char                   *name() const         { return "taint"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser; }
     virtual bool                         needTXHash() const    { return true;    }
+    virtual uint32_t                     events() const        { return kTXEvents | kEdgeEvents; }
+
+    virtual void memStats(
+        MemStats &stats
+    ) const
+    {
+        stats.addMap("srcTxMap", srcTxMap);
+        stats.addMap("taintMap", taintMap);
+    }
 
     virtual void aliases(
         std::vector<const char*> &v
@@ -14,7 +14,7 @@
 static uint8_t emptyKey[kRIPEMD160ByteSize] = { 0x52 };
 typedef GoogMap<Hash160, int, Hash160Hasher, Hash160Equal>::Map AddrMap;
 
-struct Transactions:public Callback
+struct Transactions:public Command<Transactions>
 {
     bool csv;
     optparse::OptionParser parser;
@@ -46,6 +46,7 @@ struct Transactions:public Callback
     virtual const char                   *name() const         { return "transactions"; }
     virtual const optparse::OptionParser *optionParser() const { return &parser;        }
     virtual bool                         needTXHash() const    { return true;           }
+    virtual uint32_t                     events() const        { return kOutputEvents | kEdgeEvents; }
 
     virtual void aliases(
         std::vector<const char*> &v
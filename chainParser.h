@@ -0,0 +1,553 @@
+#ifndef __CHAINPARSER_H__
+    #define __CHAINPARSER_H__
+
+    #include <util.h>
+    #include <arena.h>
+    #include <profile.h>
+    #include <common.h>
+    #include <errlog.h>
+    #include <callback.h>
+
+    #include <vector>
+    #include <type_traits>
+
+    // Where the outputs of an upstream TX are: in a blk file, or in the UTXO set
+    struct UpTX
+    {
+        const uint8_t *outputs;
+        struct UTXO   *utxo;
+    };
+
+    struct UTXOOutput
+    {
+        uint64_t value;
+        uint32_t scriptOffset;
+        uint32_t scriptSize;
+    };
+
+    // Outputs of a TX, copied out of the blk files. Followed in memory by
+    // nbOutputs UTXOOutput, then by the output scripts back to back
+    struct UTXO
+    {
+        uint32_t nbOutputs;
+        uint32_t nbUnspent;
+    };
+
+    // Upstream TX of a block's inputs are looked up in windows of that many
+    // inputs, and the outputs an input spends are prefetched that many inputs ahead
+    static const size_t kPrefetchWindow = 64;
+    static const size_t kPrefetchDistance = 8;
+
+    // TX with at least that many outputs get a table of output offsets, so an
+    // input spending one of them jumps straight to it instead of walking them all
+    static const uint64_t kMinOutputTable = 16;
+
+    // Scripts longer than that fail as soon as they run
+    static const uint64_t kMaxScriptSize = 10000;
+
+    // Outputs no input can ever spend. Zero value or empty script outputs,
+    // like the PoS coinstake marker, may still get spent: they stay
+    static inline bool isUnspendable(
+        const uint8_t *script,
+        uint64_t      scriptSize
+    )
+    {
+        if(kMaxScriptSize<scriptSize) return true;
+        return 0<scriptSize && 0x6a==script[0]; // OP_RETURN
+    }
+
+    // Parser state the second pass works with, owned by parser.cpp. Height
+    // ranges may get parsed on several threads: per block state is per thread
+    extern bool gUseUTXO;
+    extern bool gNeedUpTX;
+    extern bool gNeedTXHash;
+    extern __thread uint32_t gHooks;        // Events hooks get called for right now
+    extern uint32_t gEvents;                // Events the command subscribed to
+    extern uint64_t gChainSize;
+    extern Block *gNullBlock;
+    extern Block *gFirstBlock;
+    extern Block *gLastBlock;
+    extern Block *gStartBlock;              // First block parsed, ahead of gFirstBlock if edges need it
+    extern size_t gNextInput;
+    extern __thread const uint8_t *gNextTXHash;
+    extern std::vector<UpTX> gUpTXs;
+    extern std::vector<const uint8_t*> gUpHashes;
+    extern volatile int gMemStatsRequested;  // Set on SIGUSR1
+
+    // Parser side of the second pass, in parser.cpp: none of these calls hooks
+    bool findUpTX(const uint8_t *upTXHash, UpTX &up);
+    void addTX(const uint8_t *txHash, const uint8_t *outputs);
+    void dropUTXO(const uint8_t *txHash, UTXO *utxo);
+    uint32_t *newOutputTable(const uint8_t *txHash, uint64_t nbOutputs);
+    const uint32_t *findOutputTable(const uint8_t *txHash);
+    void enterBlock(const Block *block, const uint8_t *txs, uint64_t nbTX);
+    void leaveBlock(const Block *block, const uint8_t *header, uint64_t nbTX);
+    void pollMemStats();
+
+    // The second pass, compiled once per command type: hooks are called
+    // straight on CB, so those it doesn't override compile away and the ones
+    // it does get inlined. Instantiated on Callback itself, hooks go through
+    // the vtable, which is what commands not derived from Command<T> get
+    template<
+        typename CB
+    >
+    struct ChainParser
+    {
+        static __thread CB *cb;
+        static const bool kVirtual = std::is_same<CB, Callback>::value;
+
+        #define DO(mask, phase, x) if(0!=(gHooks & mask)) { ProfileTimer timer(phase); if(kVirtual) cb->x; else cb->CB::x; }
+            static inline void        start(const Block *s, const Block *e)        { DO(kBlockEvents,  kProfileStart,         start(s, e));               }
+            static inline void   startBlock(const Block *b)                        { DO(kBlockEvents,  kProfileStartBlock,    startBlock(b, gChainSize)); }
+            static inline void     endBlock(const Block *b)                        { DO(kBlockEvents,  kProfileEndBlock,      endBlock(b));               }
+            static inline void      startTX(const uint8_t *p, const uint8_t *hash) { DO(kTXEvents,     kProfileStartTX,       startTX(p, hash));          }
+            static inline void        endTX(const uint8_t *p)                      { DO(kTXEvents,     kProfileEndTX,         endTX(p));                  }
+            static inline void  startInputs(const uint8_t *p)                      { DO(kInputEvents,  kProfileStartInputs,   startInputs(p));            }
+            static inline void    endInputs(const uint8_t *p)                      { DO(kInputEvents,  kProfileEndInputs,     endInputs(p));              }
+            static inline void   startInput(const uint8_t *p)                      { DO(kInputEvents,  kProfileStartInput,    startInput(p));             }
+            static inline void     endInput(const uint8_t *p)                      { DO(kInputEvents,  kProfileEndInput,      endInput(p));               }
+            static inline void startOutputs(const uint8_t *p)                      { DO(kOutputEvents, kProfileStartOutputs,  startOutputs(p));           }
+            static inline void   endOutputs(const uint8_t *p)                      { DO(kOutputEvents, kProfileEndOutputs,    endOutputs(p));             }
+            static inline void  startOutput(const uint8_t *p)                      { DO(kOutputEvents, kProfileStartOutput,   startOutput(p));            }
+
+            static inline void endOutput(
+                const uint8_t *p,
+                uint64_t      value,
+                const uint8_t *txHash,
+                uint64_t      outputIndex,
+                const uint8_t *outputScript,
+                uint64_t      outputScriptSize
+            )
+            {
+                DO(
+                    kOutputEvents,
+                    kProfileEndOutput,
+                    endOutput(
+                        p,
+                        value,
+                        txHash,
+                        outputIndex,
+                        outputScript,
+                        outputScriptSize
+                    )
+                );
+            }
+
+            static inline void edge(
+                uint64_t      value,
+                const uint8_t *upTXHash,
+                uint64_t      outputIndex,
+                const uint8_t *outputScript,
+                uint64_t      outputScriptSize,
+                const uint8_t *downTXHash,
+                uint64_t      inputIndex,
+                const uint8_t *inputScript,
+                uint64_t      inputScriptSize
+            )
+            {
+                DO(
+                    kEdgeEvents,
+                    kProfileEdge,
+                    edge(
+                        value,
+                        upTXHash,
+                        outputIndex,
+                        outputScript,
+                        outputScriptSize,
+                        downTXHash,
+                        inputIndex,
+                        inputScript,
+                        inputScriptSize
+                    )
+                );
+            }
+        #undef DO
+
+        template<
+            bool skip,
+            bool fullContext
+        >
+        static void parseOutput(
+            const uint8_t *&p,
+            const uint8_t *txHash,
+            uint64_t      outputIndex,
+            const uint8_t *downTXHash,
+            uint64_t      downInputIndex,
+            const uint8_t *downInputScript,
+            uint64_t      downInputScriptSize,
+            bool          found = false
+        )
+        {
+            if(!skip && !fullContext) startOutput(p);
+
+                LOAD(uint64_t, value, p);
+                LOAD_VARINT(outputScriptSize, p);
+
+                const uint8_t *outputScript = p;
+                p += outputScriptSize;
+
+                if(!skip && fullContext && found) {
+                    edge(
+                        value,
+                        txHash,
+                        outputIndex,
+                        outputScript,
+                        outputScriptSize,
+                        downTXHash,
+                        downInputIndex,
+                        downInputScript,
+                        downInputScriptSize
+                    );
+                }
+
+            if(!skip && !fullContext) {
+                endOutput(
+                    p,
+                    value,
+                    txHash,
+                    outputIndex,
+                    outputScript,
+                    outputScriptSize
+                );
+            }
+        }
+
+        template<
+            bool skip,
+            bool fullContext
+        >
+        static void parseOutputs(
+            const uint8_t *&p,
+            const uint8_t *txHash,
+            uint64_t      stopAtIndex = -1,
+            const uint8_t *downTXHash = 0,
+            uint64_t      downInputIndex = 0,
+            const uint8_t *downInputScript = 0,
+            uint64_t      downInputScriptSize = 0
+        )
+        {
+            if(!skip && !fullContext) startOutputs(p);
+
+                const uint8_t *outputs = p;
+                LOAD_VARINT(nbOutputs, p);
+
+                uint32_t *offsets = 0;
+                bool buildTable = (
+                    !fullContext                &&
+                    gNeedUpTX                   &&
+                    !gUseUTXO                   &&
+                    kMinOutputTable<=nbOutputs
+                );
+                if(unlikely(buildTable)) offsets = newOutputTable(txHash, nbOutputs);
+
+                for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+                    if(unlikely(0!=offsets)) offsets[outputIndex] = p - outputs;
+                    bool found = fullContext && !skip && (stopAtIndex==outputIndex);
+                    parseOutput<skip, fullContext>(
+                        p,
+                        txHash,
+                        outputIndex,
+                        downTXHash,
+                        downInputIndex,
+                        downInputScript,
+                        downInputScriptSize,
+                        found
+                    );
+                    if(found) break;
+                }
+
+            if(!skip && !fullContext) endOutputs(p);
+        }
+
+        // Produce the edge for the upstream output an input spends: a direct jump
+        // through the output table when the upstream TX has one, a walk otherwise
+        static void parseUpOutput(
+            const uint8_t *upTXOutputs,
+            const uint8_t *upTXHash,
+            uint64_t      outputIndex,
+            const uint8_t *downTXHash,
+            uint64_t      downInputIndex,
+            const uint8_t *downInputScript,
+            uint64_t      downInputScriptSize
+        )
+        {
+            const uint8_t *p = upTXOutputs;
+            LOAD_VARINT(nbOutputs, p);
+
+            if(kMinOutputTable<=nbOutputs && outputIndex<nbOutputs) {
+                const uint32_t *offsets = findOutputTable(upTXHash);
+                if(likely(0!=offsets)) {
+                    p = offsets[outputIndex] + upTXOutputs;
+                    parseOutput<false, true>(
+                        p,
+                        upTXHash,
+                        outputIndex,
+                        downTXHash,
+                        downInputIndex,
+                        downInputScript,
+                        downInputScriptSize,
+                        true
+                    );
+                    return;
+                }
+            }
+
+            parseOutputs<false, true>(
+                upTXOutputs,
+                upTXHash,
+                outputIndex,
+                downTXHash,
+                downInputIndex,
+                downInputScript,
+                downInputScriptSize
+            );
+        }
+
+        // Produce the edge for a spent output straight from its UTXO copy, and
+        // evict the UTXO once the last of its spendable outputs is gone
+        static void spendUTXO(
+            UTXO          *utxo,
+            const uint8_t *upTXHash,
+            uint64_t      outputIndex,
+            const uint8_t *downTXHash,
+            uint64_t      downInputIndex,
+            const uint8_t *downInputScript,
+            uint64_t      downInputScriptSize
+        )
+        {
+            if(unlikely(utxo->nbOutputs<=outputIndex)) return;
+
+            const UTXOOutput *outputs = (const UTXOOutput*)(1 + utxo);
+            const uint8_t *scripts = (const uint8_t*)(utxo->nbOutputs + outputs);
+            const UTXOOutput &output = outputs[outputIndex];
+            const uint8_t *outputScript = output.scriptOffset + scripts;
+
+            edge(
+                output.value,
+                upTXHash,
+                outputIndex,
+                outputScript,
+                output.scriptSize,
+                downTXHash,
+                downInputIndex,
+                downInputScript,
+                downInputScriptSize
+            );
+
+            if(isUnspendable(outputScript, output.scriptSize)) return;
+            if(0<--(utxo->nbUnspent)) return;
+            dropUTXO(upTXHash, utxo);
+        }
+
+        template<
+            bool skip
+        >
+        static void parseInput(
+            const uint8_t *&p,
+            const uint8_t *txHash,
+            uint64_t      inputIndex
+        )
+        {
+            if(!skip) startInput(p);
+
+                UTXO *upUTXO = 0;
+                const uint8_t *upTXHash = p;
+                const uint8_t *upTXOutputs = 0;
+
+                if(gNeedUpTX && !skip) {
+
+                    size_t ahead = kPrefetchDistance + gNextInput;
+                    if(likely(ahead<gUpTXs.size())) {
+                        const UpTX &next = gUpTXs[ahead];
+                        if(next.outputs) __builtin_prefetch(next.outputs);
+                        if(next.utxo) __builtin_prefetch(next.utxo);
+                    }
+
+                    UpTX up = gUpTXs[gNextInput++];
+                    bool isGenTX = (0==gUpHashes[gNextInput-1]);
+                    if(likely(false==isGenTX)) {
+
+                        // Not resolved ahead: spends a TX of the current block
+                        if(0==up.outputs && 0==up.utxo) {
+                            bool found;
+                            {
+                                ProfileTimer timer(kProfileTXLookup);
+                                found = findUpTX(upTXHash, up);
+                            }
+                            if(unlikely(!found))
+                                errFatal("failed to locate upstream TX");
+                        }
+                        upTXOutputs = up.outputs;
+                        upUTXO = up.utxo;
+                    }
+                }
+
+                SKIP(uint256_t, dummyUpTXhash, p);
+                LOAD(uint32_t, upOutputIndex, p);
+                LOAD_VARINT(inputScriptSize, p);
+
+                if(!skip && 0!=upTXOutputs) {
+                    const uint8_t *inputScript = p;
+                    parseUpOutput(
+                        upTXOutputs,
+                        upTXHash,
+                        upOutputIndex,
+                        txHash,
+                        inputIndex,
+                        inputScript,
+                        inputScriptSize
+                    );
+                }
+
+                if(!skip && 0!=upUTXO) {
+                    spendUTXO(
+                        upUTXO,
+                        upTXHash,
+                        upOutputIndex,
+                        txHash,
+                        inputIndex,
+                        p,
+                        inputScriptSize
+                    );
+                }
+
+                p += inputScriptSize;
+                SKIP(uint32_t, sequence, p);
+
+            if(!skip) endInput(p);
+        }
+
+        template<
+            bool skip
+        >
+        static void parseInputs(
+            const uint8_t *&p,
+            const uint8_t *txHash
+        )
+        {
+            if(!skip) startInputs(p);
+
+                LOAD_VARINT(nbInputs, p);
+                profileCount(kProfileSecondPass, 0, 0, 0, nbInputs);
+                for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex)
+                    parseInput<skip>(p, txHash, inputIndex);
+
+            if(!skip) endInputs(p);
+        }
+
+        template<
+            bool skip
+        >
+        static void parseTX(
+            const uint8_t *&p
+        )
+        {
+            uint8_t *txHash = 0;
+
+            if(gNeedTXHash && !skip) {
+                txHash = (uint8_t*)gNextTXHash;
+                gNextTXHash += kSHA256ByteSize;
+            }
+
+            if(!skip) startTX(p, txHash);
+
+                SKIP(uint32_t, version, p);
+                SKIP(uint32_t, ntime, p);
+
+                // Sub-walks nobody subscribed to just hop over their bytes
+                if(0!=(gEvents & (kInputEvents | kEdgeEvents))) parseInputs<skip>(p, txHash);
+                else                                             parseInputs<true>(p, txHash);
+
+                if(gNeedUpTX && !skip) addTX(txHash, p);
+
+                if(0!=(gEvents & kOutputEvents)) parseOutputs<skip, false>(p, txHash);
+                else                             parseOutputs<true, false>(p, txHash);
+
+                SKIP(uint32_t, lockTime, p);
+
+            if(!skip) endTX(p);
+        }
+
+        static void parseBlock(
+            const Block *block
+        )
+        {
+            blockArena().reset();
+            if(unlikely(gProfile)) {
+                uint32_t size;
+                memcpy(&size, block->data - 4, sizeof(size));
+                profileCount(kProfileSecondPass, size, 1, 0, 0);
+            }
+
+            startBlock(block);
+            if(unlikely(cb->stopRequested)) return;
+
+                // Commands that only want blocks never get TX bytes read
+                if(likely(kBlockEvents!=gEvents)) {
+                    const uint8_t *p = block->data;
+                    const uint8_t *header = p;
+                    SKIP(uint32_t, version, p);
+                    SKIP(uint256_t, prevBlkHash, p);
+                    SKIP(uint256_t, blkMerkleRoot, p);
+                    SKIP(uint32_t, blkTime, p);
+                    SKIP(uint32_t, blkBits, p);
+                    SKIP(uint32_t, blkNonce, p);
+                    LOAD_VARINT(nbTX, p);
+                    profileCount(kProfileSecondPass, 0, 0, nbTX, 0);
+
+                    enterBlock(block, p, nbTX);
+                    for(uint64_t txIndex=0; likely(txIndex<nbTX); ++txIndex)
+                        parseTX<false>(p);
+                    leaveBlock(block, header, nbTX);
+                }
+
+            endBlock(block);
+        }
+
+        static void parseRange(
+            CB          *callback,
+            const Block *first,
+            const Block *last
+        )
+        {
+            cb = callback;
+
+            const Block *blk = first;
+            while(1) {
+                gHooks = (blk->height<gFirstBlock->height) ? 0 : gEvents;
+                if(unlikely(gMemStatsRequested)) pollMemStats();
+                parseBlock(blk);
+                if(unlikely(last==blk || cb->stopRequested)) break;
+                blk = blk->next;
+            }
+            gHooks = gEvents;
+        }
+
+        static void parseChain(
+            CB *callback
+        )
+        {
+            cb = callback;
+            gHooks = gEvents;
+            start(gFirstBlock, gLastBlock);
+            parseRange(callback, gStartBlock, gLastBlock);
+        }
+    };
+
+    template<typename CB> __thread CB *ChainParser<CB>::cb = 0;
+
+    template<typename T> void Command<T>::parseChain()
+    {
+        ChainParser<T>::parseChain(static_cast<T*>(this));
+    }
+
+    template<typename T> void Command<T>::parseRange(
+        const Block *first,
+        const Block *last
+    )
+    {
+        ChainParser<T>::parseRange(static_cast<T*>(this), first, last);
+    }
+
+#endif // __CHAINPARSER_H__
+
@@ -0,0 +1,319 @@
+#ifndef __HASHTABLE_H__
+    #define __HASHTABLE_H__
+
+    #include <stdlib.h>
+    #include <string.h>
+    #include <common.h>
+    #include <errlog.h>
+    #include <hugePages.h>
+
+    #if defined(__SSE2__)
+        #include <emmintrin.h>
+    #endif
+
+    // Open-addressed table keyed by pointers to kKeySize byte hashes (TX, block
+    // or address hashes), tuned for the parser's hot lookups.
+    //
+    // Slots come in aligned groups of 16. Each slot has a control byte that is
+    // either empty, deleted, or holds a 7 bit fingerprint of the slot's key, and
+    // a whole group of control bytes is matched in one SIMD compare. A probe
+    // thus only dereferences a key pointer (a likely cache miss) when its
+    // fingerprint matches, instead of once per slot visited like dense_hash_map.
+    //
+    // Keys are hashes already, so their first 8 bytes are used as hash value.
+    // Key pointers must stay valid for as long as they are in the table.
+    template<
+        typename Value,
+        size_t   kKeySize
+    >
+    struct HashTable
+    {
+        typedef const uint8_t *Key;
+
+        struct Entry
+        {
+            Key   first;
+            Value second;
+        };
+
+        // A control byte and an entry
+        enum { kSlotByteSize = 1 + sizeof(Entry) };
+
+        struct iterator
+        {
+            const HashTable *table;
+            uint64_t        index;
+
+            iterator(const HashTable *t, uint64_t i) : table(t), index(i) {                     }
+            Entry &operator*() const                                      { return table->slots[index];  }
+            Entry *operator->() const                                     { return table->slots + index; }
+            bool operator==(const iterator &o) const                      { return index==o.index;       }
+            bool operator!=(const iterator &o) const                      { return index!=o.index;       }
+
+            iterator &operator++()
+            {
+                index = table->nextFull(1 + index);
+                return *this;
+            }
+
+            iterator operator++(int)
+            {
+                iterator r = *this;
+                ++(*this);
+                return r;
+            }
+        };
+
+        HashTable()
+        {
+            ctrl = 0;
+            slots = 0;
+            capacity = 0;
+            groupMask = 0;
+            count = 0;
+            nbDeleted = 0;
+            nbResizes = 0;
+            rehash(kGroupSize);
+        }
+
+        ~HashTable()
+        {
+            hugeFree(ctrl, capacity);
+            hugeFree(slots, capacity*sizeof(Entry));
+        }
+
+        uint64_t        size() const { return count;                      }
+        uint64_t bucketCount() const { return capacity;                   }
+        uint64_t resizeCount() const { return nbResizes;                  }
+        iterator       begin() const { return iterator(this, nextFull(0)); }
+        iterator         end() const { return iterator(this, capacity);    }
+
+        // Make room for n entries without further rehashing
+        void resize(
+            uint64_t n
+        )
+        {
+            uint64_t c = kGroupSize;
+            while((c*kMaxLoad)<(n*kLoadScale)) c <<= 1;
+            if(capacity<c) rehash(c);
+        }
+
+        iterator find(
+            Key key
+        ) const
+        {
+            uint64_t h = hashOf(key);
+            uint8_t fingerprint = h & 0x7F;
+            uint64_t group = (h>>7) & groupMask;
+            uint64_t step = 0;
+            while(1) {
+
+                const uint8_t *g = kGroupSize*group + ctrl;
+                uint32_t match = matchByte(g, fingerprint);
+                while(match) {
+                    uint64_t i = kGroupSize*group + __builtin_ctz(match);
+                    if(likely(equal(slots[i].first, key))) return iterator(this, i);
+                    match &= (match - 1);
+                }
+
+                if(likely(0!=matchByte(g, kEmpty))) return end();
+                group = (group + ++step) & groupMask;
+            }
+        }
+
+        // A lookup costs a miss on the key's control group and slots, then
+        // one on the key behind each fingerprint match. Batched lookups hide
+        // both by calling prefetchGroup for every key, then prefetchKeys for
+        // every key, before the actual finds
+        void prefetchGroup(
+            Key key
+        ) const
+        {
+            uint64_t group = (hashOf(key)>>7) & groupMask;
+            const Entry *entries = kGroupSize*group + slots;
+            __builtin_prefetch(kGroupSize*group + ctrl);
+            for(size_t i=0; i<sizeof(Entry)*kGroupSize; i+=64) {
+                __builtin_prefetch(i + (const uint8_t*)entries);
+            }
+        }
+
+        void prefetchKeys(
+            Key key
+        ) const
+        {
+            uint64_t h = hashOf(key);
+            uint64_t group = (h>>7) & groupMask;
+            uint32_t match = matchByte(kGroupSize*group + ctrl, h & 0x7F);
+            while(match) {
+                __builtin_prefetch(slots[kGroupSize*group + __builtin_ctz(match)].first);
+                match &= (match - 1);
+            }
+        }
+
+        Value &operator[](
+            Key key
+        )
+        {
+            iterator i = find(key);
+            if(likely(end()!=i)) return i->second;
+
+            if(unlikely((capacity*kMaxLoad)<((count + nbDeleted + 1)*kLoadScale))) {
+                // Grow if live entries fill over half the table, else just purge tombstones
+                bool grow = ((capacity*kMaxLoad)<(2*(count + 1)*kLoadScale));
+                rehash(grow ? 2*capacity : capacity);
+            }
+
+            Entry &entry = slots[insertSlot(key)];
+            entry.first = key;
+            entry.second = Value();
+            ++count;
+            return entry.second;
+        }
+
+        bool erase(
+            Key key
+        )
+        {
+            iterator i = find(key);
+            if(unlikely(end()==i)) return false;
+
+            // A probe that reaches a group with an empty slot stops there, so
+            // if this group has one, no probe goes through it: no tombstone needed
+            const uint8_t *g = (i.index & ~(kGroupSize - 1)) + ctrl;
+            bool stops = (0!=matchByte(g, kEmpty));
+            ctrl[i.index] = stops ? kEmpty : kDeleted;
+            if(!stops) ++nbDeleted;
+            --count;
+            return true;
+        }
+
+    private:
+        enum {
+            kGroupSize = 16,
+            kEmpty = 0x80,
+            kDeleted = 0xFE,
+            kMaxLoad = 7,
+            kLoadScale = 8
+        };
+
+        HashTable(const HashTable &);
+        HashTable &operator=(const HashTable &);
+
+        // Only right if keys are uniformly distributed hashes, as the first 8
+        // bytes pick the probe group. All tables here are keyed by double
+        // sha256 digests: TX hashes for the parser's TX, UTXO and output
+        // table maps, block hashes for its block map (the zero bits of those
+        // are at the other end). Keys may sit at any alignment
+        static inline uint64_t hashOf(
+            Key key
+        )
+        {
+            uint64_t h;
+            memcpy(&h, key, sizeof(h));
+            return h;
+        }
+
+        static inline bool equal(
+            Key a,
+            Key b
+        )
+        {
+            return 0==memcmp(a, b, kKeySize);
+        }
+
+        // Bit i of result is set if control byte i of group equals b
+        static inline uint32_t matchByte(
+            const uint8_t *g,
+            uint8_t       b
+        )
+        {
+            #if defined(__SSE2__)
+                __m128i group = _mm_load_si128((const __m128i*)g);
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+            #else
+                uint32_t match = 0;
+                for(int i=0; i<kGroupSize; ++i) match |= ((g[i]==b) << i);
+                return match;
+            #endif
+        }
+
+        // Bit i of result is set if slot i of group is empty or deleted
+        static inline uint32_t matchFree(
+            const uint8_t *g
+        )
+        {
+            #if defined(__SSE2__)
+                __m128i group = _mm_load_si128((const __m128i*)g);
+                return _mm_movemask_epi8(group);
+            #else
+                uint32_t match = 0;
+                for(int i=0; i<kGroupSize; ++i) match |= ((g[i]>>7) << i);
+                return match;
+            #endif
+        }
+
+        uint64_t nextFull(
+            uint64_t i
+        ) const
+        {
+            while(i<capacity && 0!=(ctrl[i] & 0x80)) ++i;
+            return i;
+        }
+
+        uint64_t insertSlot(
+            Key key
+        )
+        {
+            uint64_t h = hashOf(key);
+            uint64_t group = (h>>7) & groupMask;
+            uint64_t step = 0;
+            while(1) {
+
+                uint32_t match = matchFree(kGroupSize*group + ctrl);
+                if(likely(0!=match)) {
+                    uint64_t i = kGroupSize*group + __builtin_ctz(match);
+                    if(kDeleted==ctrl[i]) --nbDeleted;
+                    ctrl[i] = h & 0x7F;
+                    return i;
+                }
+                group = (group + ++step) & groupMask;
+            }
+        }
+
+        void rehash(
+            uint64_t newCapacity
+        )
+        {
+            uint8_t *oldCtrl = ctrl;
+            Entry *oldSlots = slots;
+            uint64_t oldCapacity = capacity;
+            if(0<oldCapacity && newCapacity!=oldCapacity) ++nbResizes;
+
+            ctrl = (uint8_t*)hugeAlloc(newCapacity);
+            slots = (Entry*)hugeAlloc(newCapacity*sizeof(Entry));
+
+            memset(ctrl, kEmpty, newCapacity);
+            capacity = newCapacity;
+            groupMask = (newCapacity/kGroupSize) - 1;
+            nbDeleted = 0;
+
+            for(uint64_t i=0; i<oldCapacity; ++i) {
+                if(0!=(oldCtrl[i] & 0x80)) continue;
+                slots[insertSlot(oldSlots[i].first)] = oldSlots[i];
+            }
+
+            hugeFree(oldCtrl, oldCapacity);
+            hugeFree(oldSlots, oldCapacity*sizeof(Entry));
+        }
+
+        uint8_t  *ctrl;
+        Entry    *slots;
+        uint64_t capacity;
+        uint64_t groupMask;
+        uint64_t count;
+        uint64_t nbDeleted;
+        uint64_t nbResizes;
+    };
+
+#endif // __HASHTABLE_H__
+
@@ -0,0 +1,350 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <profile.h>
+#include <callback.h>
+#include <hookProfiler.h>
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+enum
+{
+    kStartMap,
+    kEndMap,
+    kScanStartBlock,
+    kScanEndBlock,
+    kStart,
+    kStartBlock,
+    kEndBlock,
+    kStartTX,
+    kEndTX,
+    kStartInputs,
+    kEndInputs,
+    kStartInput,
+    kEndInput,
+    kStartOutputs,
+    kEndOutputs,
+    kStartOutput,
+    kEndOutput,
+    kEdge,
+    kWrapup,
+    kNbHooks
+};
+
+static const char *const kHookNames[kNbHooks] = {
+    "startMap",
+    "endMap",
+    "startBlock (scan)",
+    "endBlock (scan)",
+    "start",
+    "startBlock",
+    "endBlock",
+    "startTX",
+    "endTX",
+    "startInputs",
+    "endInputs",
+    "startInput",
+    "endInput",
+    "startOutputs",
+    "endOutputs",
+    "startOutput",
+    "endOutput",
+    "edge",
+    "wrapup"
+};
+
+// Bucket i holds calls that took [2^i, 2^(i+1)) cycles
+static const int kNbBuckets = 48;
+
+// How many hooks get their histogram shown
+static const size_t kNbOffenders = 3;
+
+struct HookStats
+{
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t maxCycles;
+    uint64_t buckets[kNbBuckets];
+};
+
+struct HookProfiler:public Callback
+{
+    Callback  *command;
+    bool      owned;            // A part forked off the command: goes with the wrapper
+    double    startUsecs;
+    uint64_t  startClock;
+    HookStats stats[kNbHooks];
+
+    // Built from a copy of the command's base, as forked parts are: the
+    // wrapper never joins the list of commands Callback::find goes through
+    HookProfiler(
+        Callback *c,
+        bool     o
+    ) : Callback(*c)
+    {
+        command = c;
+        owned = o;
+        startUsecs = usecs();
+        startClock = profileClock();
+        memset(stats, 0, sizeof(stats));
+    }
+
+    virtual ~HookProfiler()
+    {
+        if(owned) delete command;
+    }
+
+    inline void record(
+        int      hook,
+        uint64_t start
+    )
+    {
+        uint64_t cycles = profileClock() - start;
+        HookStats &s = stats[hook];
+        ++s.calls;
+        s.cycles += cycles;
+        if(s.maxCycles<cycles) s.maxCycles = cycles;
+
+        int bucket = 63 - __builtin_clzll(cycles | 1);
+        if(kNbBuckets<=bucket) bucket = kNbBuckets - 1;
+        ++s.buckets[bucket];
+
+        stopRequested = command->stopRequested;
+    }
+
+    #define TIME(hook, x) uint64_t start = profileClock(); command->x; record(hook, start)
+
+    virtual const char           *name(                            ) const { return command->name();         }
+    virtual const Parser *optionParser(                            ) const { return command->optionParser(); }
+    virtual void               aliases(std::vector<const char *> &v) const { command->aliases(v);            }
+    virtual bool            needTXHash(                            ) const { return command->needTXHash();   }
+    virtual uint32_t            events(                            ) const { return command->events();       }
+    virtual bool           asyncEvents(                            ) const { return command->asyncEvents();  }
+    virtual void              memStats(MemStats &stats             ) const { command->memStats(stats);       }
+
+    virtual void     startMap(const uint8_t *p                     )       { TIME(kStartMap,       startMap(p));                }
+    virtual void       endMap(const uint8_t *p                     )       { TIME(kEndMap,         endMap(p));                  }
+    virtual void   startBlock(const uint8_t *p                     )       { TIME(kScanStartBlock, startBlock(p));              }
+    virtual void     endBlock(const uint8_t *p                     )       { TIME(kScanEndBlock,   endBlock(p));                }
+    virtual void        start(  const Block *s, const Block *e     )       { TIME(kStart,          start(s, e));                }
+    virtual void      startTX(const uint8_t *p, const uint8_t *hash)       { TIME(kStartTX,        startTX(p, hash));           }
+    virtual void        endTX(const uint8_t *p                     )       { TIME(kEndTX,          endTX(p));                   }
+    virtual void  startInputs(const uint8_t *p                     )       { TIME(kStartInputs,    startInputs(p));             }
+    virtual void    endInputs(const uint8_t *p                     )       { TIME(kEndInputs,      endInputs(p));               }
+    virtual void   startInput(const uint8_t *p                     )       { TIME(kStartInput,     startInput(p));              }
+    virtual void     endInput(const uint8_t *p                     )       { TIME(kEndInput,       endInput(p));                }
+    virtual void startOutputs(const uint8_t *p                     )       { TIME(kStartOutputs,   startOutputs(p));            }
+    virtual void   endOutputs(const uint8_t *p                     )       { TIME(kEndOutputs,     endOutputs(p));              }
+    virtual void  startOutput(const uint8_t *p                     )       { TIME(kStartOutput,    startOutput(p));             }
+    virtual void   startBlock(  const Block *b, uint64_t chainSize )       { TIME(kStartBlock,     startBlock(b, chainSize));   }
+    virtual void     endBlock(  const Block *b                     )       { TIME(kEndBlock,       endBlock(b));                }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        uint64_t      value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        TIME(
+            kEndOutput,
+            endOutput(
+                p,
+                value,
+                txHash,
+                outputIndex,
+                outputScript,
+                outputScriptSize
+            )
+        );
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        TIME(
+            kEdge,
+            edge(
+                value,
+                upTXHash,
+                outputIndex,
+                outputScript,
+                outputScriptSize,
+                downTXHash,
+                inputIndex,
+                inputScript,
+                inputScriptSize
+            )
+        );
+    }
+
+    #undef TIME
+
+    // Parts get wrapped too, and their counts folded back in along with them
+    virtual Callback *fork() const
+    {
+        Callback *part = command->fork();
+        if(0==part) return 0;
+
+        HookProfiler *wrapper = new HookProfiler(part, true);
+        wrapper->startUsecs = startUsecs;
+        wrapper->startClock = startClock;
+        return wrapper;
+    }
+
+    virtual void merge(
+        Callback *part
+    )
+    {
+        HookProfiler *wrapper = (HookProfiler*)part;
+        command->merge(wrapper->command);
+        for(int i=0; i<kNbHooks; ++i) {
+            HookStats &to = stats[i];
+            const HookStats &from = wrapper->stats[i];
+            to.calls += from.calls;
+            to.cycles += from.cycles;
+            if(to.maxCycles<from.maxCycles) to.maxCycles = from.maxCycles;
+            for(int j=0; j<kNbBuckets; ++j) to.buckets[j] += from.buckets[j];
+        }
+    }
+
+    // Upper bound of the bucket the pth fraction of calls falls into, or the
+    // slowest call if that comes first
+    static uint64_t percentile(
+        const HookStats &s,
+        double          p
+    )
+    {
+        uint64_t rank = (uint64_t)(p*s.calls);
+        uint64_t seen = 0;
+        for(int i=0; i<kNbBuckets; ++i) {
+            seen += s.buckets[i];
+            if(rank<seen) return std::min(2ULL<<i, (unsigned long long)s.maxCycles);
+        }
+        return s.maxCycles;
+    }
+
+    static bool costlier(
+        const HookStats *a,
+        const HookStats *b
+    )
+    {
+        return b->cycles<a->cycles;
+    }
+
+    void showHistogram(
+        const HookStats &s,
+        double          nsPerCycle
+    )
+    {
+        uint64_t most = 0;
+        for(int i=0; i<kNbBuckets; ++i) if(most<s.buckets[i]) most = s.buckets[i];
+
+        fprintf(stderr, "\n    %s, ns per call:\n", kHookNames[&s - stats]);
+        for(int i=0; i<kNbBuckets; ++i) {
+
+            if(0==s.buckets[i]) continue;
+
+            char bar[41];
+            int width = (int)((40*s.buckets[i] + most - 1)/most);
+            memset(bar, '#', width);
+            bar[width] = 0;
+
+            fprintf(
+                stderr,
+                "        %12.0f - %-12.0f %12" PRIu64 " %s\n",
+                (0<i) ? nsPerCycle*(1ULL<<i) : 0.0,
+                nsPerCycle*(2ULL<<i),
+                s.buckets[i],
+                bar
+            );
+        }
+    }
+
+    void report()
+    {
+        double elapsed = (usecs() - startUsecs)*1e3;
+        uint64_t clocks = profileClock() - startClock;
+        double nsPerCycle = (0<clocks) ? elapsed/clocks : 0.0;
+
+        std::vector<const HookStats*> sorted;
+        uint64_t total = 0;
+        for(int i=0; i<kNbHooks; ++i) {
+            if(0==stats[i].calls) continue;
+            sorted.push_back(stats + i);
+            total += stats[i].cycles;
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), costlier);
+        if(sorted.empty()) return;
+
+        info(
+            "hooks of \"%s\": %.3f seconds, %.1f%% of the run",
+            command->name(),
+            nsPerCycle*total*1e-9,
+            (0.0<elapsed) ? 100.0*(nsPerCycle*total)/elapsed : 0.0
+        );
+        fprintf(
+            stderr,
+            "    %-18s %12s %10s %7s %10s %10s %10s %12s\n",
+            "hook",
+            "calls",
+            "seconds",
+            "share",
+            "mean ns",
+            "p50 ns",
+            "p99 ns",
+            "max ns"
+        );
+
+        for(size_t i=0; i<sorted.size(); ++i) {
+
+            const HookStats &s = *sorted[i];
+            fprintf(
+                stderr,
+                "    %-18s %12" PRIu64 " %10.3f %6.1f%% %10.0f %10.0f %10.0f %12.0f\n",
+                kHookNames[&s - stats],
+                s.calls,
+                nsPerCycle*s.cycles*1e-9,
+                100.0*s.cycles/total,
+                nsPerCycle*s.cycles/s.calls,
+                nsPerCycle*percentile(s, 0.50),
+                nsPerCycle*percentile(s, 0.99),
+                nsPerCycle*s.maxCycles
+            );
+        }
+
+        for(size_t i=0; i<sorted.size() && i<kNbOffenders; ++i) showHistogram(*sorted[i], nsPerCycle);
+        fprintf(stderr, "\n");
+        fflush(stderr);
+    }
+
+    virtual void wrapup()
+    {
+        uint64_t start = profileClock();
+        command->wrapup();
+        record(kWrapup, start);
+        report();
+    }
+};
+
+Callback *profileHooks(
+    Callback *command
+)
+{
+    return new HookProfiler(command, false);
+}
@@ -0,0 +1,16 @@
+#ifndef __HOOKPROFILER_H__
+    #define __HOOKPROFILER_H__
+
+    #include <callback.h>
+
+    // Wrap a command so that each of its hook calls gets timed on the CPU's
+    // cycle counter, into per hook call counts and latency histograms with
+    // power of two buckets. The hooks that cost the most get shown, with
+    // their histograms, once the command's wrapup returns.
+    //
+    // The wrapper goes through the vtable for every hook, as commands not
+    // derived from Command<T> do: times include that call, not the parser
+    Callback *profileHooks(Callback *command);
+
+#endif // __HOOKPROFILER_H__
+
@@ -0,0 +1,134 @@
+
+#include <common.h>
+#include <errlog.h>
+#include <hugePages.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static bool gOn = true;
+static bool gNoHugeTLB = false;
+static uint64_t gNbHugeTLBPages = 0;
+static uint64_t gNbAdvisedPages = 0;
+
+void setHugePages(
+    bool on
+)
+{
+    gOn = on;
+}
+
+bool hugePages()
+{
+    return gOn;
+}
+
+static size_t roundUp(
+    size_t size
+)
+{
+    return (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+// The kernel only hands out transparent huge pages for 2MB aligned ranges:
+// map 2MB more than asked, then trim both ends down to an aligned range
+static void *alignedMap(
+    size_t size
+)
+{
+    size_t mapSize = size + kHugePageSize;
+    void *p = mmap(0, mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED==p) return 0;
+
+    uintptr_t start = (uintptr_t)p;
+    uintptr_t aligned = (start + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1);
+    size_t head = aligned - start;
+    size_t tail = mapSize - head - size;
+    if(0<head) munmap(p, head);
+    if(0<tail) munmap((void*)(aligned + size), tail);
+    return (void*)aligned;
+}
+
+void *hugeAlloc(
+    size_t size
+)
+{
+    if(size<kHugePageSize) {
+        void *p = 0;
+        int r = posix_memalign(&p, 64, size);
+        if(0!=r) errFatal("failed to allocate %" PRIu64 " bytes", (uint64_t)size);
+        return p;
+    }
+
+    size = roundUp(size);
+    uint64_t nbPages = size/kHugePageSize;
+
+    // Explicit huge pages are reserved at mmap time: past that, they can't
+    // fail on first touch. Once the system runs out, stop asking
+    if(gOn && !gNoHugeTLB) {
+        void *p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(MAP_FAILED!=p) {
+            __sync_fetch_and_add(&gNbHugeTLBPages, nbPages);
+            return p;
+        }
+        gNoHugeTLB = true;
+    }
+
+    void *p = alignedMap(size);
+    if(0==p) sysErrFatal("failed to allocate %" PRIu64 " bytes", (uint64_t)size);
+
+    int r = madvise(p, size, gOn ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    if(0==r && gOn) __sync_fetch_and_add(&gNbAdvisedPages, nbPages);
+    return p;
+}
+
+void hugeFree(
+    void   *p,
+    size_t size
+)
+{
+    if(0==p) return;
+    if(size<kHugePageSize) {
+        free(p);
+        return;
+    }
+
+    int r = munmap(p, roundUp(size));
+    if(r<0) sysErr("failed to unmap %" PRIu64 " bytes", (uint64_t)size);
+}
+
+// Whether advised memory actually got huge pages is up to the kernel and
+// to how fragmented memory is: ask it
+static uint64_t anonHugeKB()
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if(0==f) return 0;
+
+    uint64_t kb = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), f)) {
+        unsigned long long n;
+        if(1==sscanf(line, "AnonHugePages: %llu kB", &n)) {
+            kb = n;
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void hugePagesReport()
+{
+    if(0==gNbHugeTLBPages && 0==gNbAdvisedPages) return;
+
+    uint64_t pageMB = kHugePageSize>>20;
+    info(
+        "huge pages: %" PRIu64 " hugetlb pages (%" PRIu64 " MB), %" PRIu64 " MB advised for transparent huge pages, %" PRIu64 " MB backed by them",
+        gNbHugeTLBPages,
+        gNbHugeTLBPages*pageMB,
+        gNbAdvisedPages*pageMB,
+        anonHugeKB()>>10
+    );
+}
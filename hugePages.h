@@ -0,0 +1,31 @@
+#ifndef __HUGEPAGES_H__
+    #define __HUGEPAGES_H__
+
+    #include <stddef.h>
+    #include <common.h>
+
+    // Storage for the parser's big, randomly accessed structures: hash table
+    // slots and allocator pools. Lookups into those miss the TLB on nearly
+    // every access with 4KB pages, one 2MB page covers 512 of them.
+    //
+    // Allocations of kHugePageSize or more get rounded up to a multiple of
+    // it and come from explicit hugetlb pages when the system has some set
+    // aside (vm.nr_hugepages), else from 2MB aligned memory advised for
+    // transparent huge pages. Smaller ones go to the C heap, 64 byte aligned.
+    // Memory is not necessarily zeroed.
+    static const size_t kHugePageSize = 2*1024*1024;
+
+    // When off, big allocations get advised against huge pages instead.
+    // Only affects allocations made from then on
+    void setHugePages(bool on);
+    bool hugePages();
+
+    // size must be the same on free as on alloc
+    void *hugeAlloc(size_t size);
+    void hugeFree(void *p, size_t size);
+
+    // Log how many huge pages allocations got so far
+    void hugePagesReport();
+
+#endif // __HUGEPAGES_H__
+
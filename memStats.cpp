@@ -0,0 +1,142 @@
+
+#include <arena.h>
+#include <common.h>
+#include <errlog.h>
+#include <memStats.h>
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+void MemStats::add(
+    const char *name,
+    uint64_t   reserved,
+    uint64_t   used,
+    uint64_t   nbEntries,
+    uint64_t   nbBuckets,
+    int64_t    nbResizes
+)
+{
+    Item item;
+    item.name = owner.empty() ? std::string(name) : owner + "." + name;
+    item.reserved = reserved;
+    item.used = used;
+    item.nbEntries = nbEntries;
+    item.nbBuckets = nbBuckets;
+    item.nbResizes = nbResizes;
+    items.push_back(item);
+}
+
+void MemStats::add(
+    const Arena &arena
+)
+{
+    if(0==arena.allocCount()) return;
+    add(
+        arena.name(),
+        arena.reservedBytes(),
+        arena.usedBytes(),
+        arena.allocCount()
+    );
+}
+
+static bool biggerFirst(
+    const MemStats::Item &a,
+    const MemStats::Item &b
+)
+{
+    return b.reserved<a.reserved;
+}
+
+void MemStats::print() const
+{
+    std::vector<Item> sorted(items);
+    std::stable_sort(sorted.begin(), sorted.end(), biggerFirst);
+
+    uint64_t reserved = 0;
+    uint64_t used = 0;
+    for(size_t i=0; i<sorted.size(); ++i) {
+        reserved += sorted[i].reserved;
+        used += sorted[i].used;
+    }
+
+    info("memory: %.1f MB reserved, %.1f MB used", reserved*1e-6, used*1e-6);
+    fprintf(
+        stderr,
+        "    %-28s %12s %12s %12s %6s %8s\n",
+        "structure",
+        "reserved",
+        "used",
+        "entries",
+        "load",
+        "resizes"
+    );
+
+    for(size_t i=0; i<sorted.size(); ++i) {
+
+        const Item &item = sorted[i];
+
+        char load[16] = "-";
+        if(0<item.nbBuckets) snprintf(load, sizeof(load), "%.2f", item.nbEntries/(double)item.nbBuckets);
+
+        char resizes[24] = "-";
+        if(0<=item.nbResizes) snprintf(resizes, sizeof(resizes), "%" PRId64, item.nbResizes);
+
+        fprintf(
+            stderr,
+            "    %-28s %9.1f MB %9.1f MB %12" PRIu64 " %6s %8s\n",
+            item.name.c_str(),
+            item.reserved*1e-6,
+            item.used*1e-6,
+            item.nbEntries,
+            load,
+            resizes
+        );
+    }
+    fflush(stderr);
+}
+
+// Written to a temporary file first: whoever watches the file never sees
+// half a report
+bool MemStats::writeJSON(
+    const char *path
+) const
+{
+    std::string tmpName = std::string(path) + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) {
+        sysErr("failed to create %s", tmpName.c_str());
+        return false;
+    }
+
+    fprintf(f, "{\n    \"structures\": [\n");
+    for(size_t i=0; i<items.size(); ++i) {
+
+        const Item &item = items[i];
+        double load = (0<item.nbBuckets) ? item.nbEntries/(double)item.nbBuckets : 0.0;
+        fprintf(
+            f,
+            "        {\"name\": \"%s\", \"reserved\": %" PRIu64 ", \"used\": %" PRIu64 ", \"entries\": %" PRIu64
+            ", \"buckets\": %" PRIu64 ", \"loadFactor\": %.4f, \"resizes\": %" PRId64 "}%s\n",
+            item.name.c_str(),
+            item.reserved,
+            item.used,
+            item.nbEntries,
+            item.nbBuckets,
+            load,
+            item.nbResizes,
+            (i + 1<items.size()) ? "," : ""
+        );
+    }
+    fprintf(f, "    ]\n}\n");
+
+    bool ok = (0==fclose(f));
+    if(ok) ok = (0==rename(tmpName.c_str(), path));
+    if(!ok) {
+        sysErr("failed to write %s", path);
+        unlink(tmpName.c_str());
+    }
+    return ok;
+}
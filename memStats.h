@@ -0,0 +1,93 @@
+#ifndef __MEMSTATS_H__
+    #define __MEMSTATS_H__
+
+    #include <string>
+    #include <vector>
+    #include <common.h>
+
+    struct Arena;
+
+    // Breakdown of the memory held by the parser's big structures and by the
+    // command's, for telling which one a run that runs out of memory blames.
+    // Byte counts are what the structures hold themselves: keys and objects
+    // they point to are accounted for wherever they are allocated.
+    struct MemStats
+    {
+        struct Item
+        {
+            std::string name;
+            uint64_t    reserved;       // Bytes held, in use or not
+            uint64_t    used;           // Bytes holding live entries
+            uint64_t    nbEntries;
+            uint64_t    nbBuckets;      // Hash tables only, 0 otherwise
+            int64_t     nbResizes;      // -1 when the structure doesn't tell
+        };
+
+        std::vector<Item> items;
+
+        // Item names get prefixed by this, as in "balances.addrMap"
+        std::string owner;
+
+        void add(
+            const char *name,
+            uint64_t   reserved,
+            uint64_t   used,
+            uint64_t   nbEntries,
+            uint64_t   nbBuckets = 0,
+            int64_t    nbResizes = -1
+        );
+
+        void add(const Arena &arena);
+
+        // The parser's HashTable, or anything else that tells its slot
+        // size, slot count and resize count
+        template<typename Table> void addTable(
+            const char  *name,
+            const Table &table
+        )
+        {
+            add(
+                name,
+                table.bucketCount()*Table::kSlotByteSize,
+                table.size()*Table::kSlotByteSize,
+                table.size(),
+                table.bucketCount(),
+                table.resizeCount()
+            );
+        }
+
+        // dense_hash_map and sparse_hash_map, counted as dense
+        template<typename Map> void addMap(
+            const char *name,
+            const Map  &map
+        )
+        {
+            uint64_t slotSize = sizeof(typename Map::value_type);
+            add(
+                name,
+                map.bucket_count()*slotSize,
+                map.size()*slotSize,
+                map.size(),
+                map.bucket_count()
+            );
+        }
+
+        template<typename T> void addVector(
+            const char           *name,
+            const std::vector<T> &v
+        )
+        {
+            add(
+                name,
+                v.capacity()*sizeof(T),
+                v.size()*sizeof(T),
+                v.size()
+            );
+        }
+
+        void print() const;
+        bool writeJSON(const char *path) const;
+    };
+
+#endif // __MEMSTATS_H__
+
@@ -1,343 +1,1255 @@
 
 #include <util.h>
+#include <arena.h>
 #include <common.h>
 #include <errlog.h>
+#include <option.h>
+#include <parser.h>
+#include <txStore.h>
+#include <hashTable.h>
 #include <callback.h>
+#include <taskPool.h>
+#include <chainParser.h>
+#include <blockIndex.h>
+#include <blockSource.h>
+#include <hugePages.h>
+#include <memStats.h>
+#include <profile.h>
+#include <hookProfiler.h>
+#include <utxoSnapshot.h>
 
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <stdio.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unordered_map>
+#include <boost/thread.hpp>
 
 #if !defined(O_DIRECT)
 #   define O_DIRECT 0
 #endif
 
-struct Map
+struct ScannedBlock
 {
-    int fd;
-    uint64_t size;
-    const uint8_t *p;
-    std::string name;
+    const uint8_t *data;
+    uint256_t     hash;
 };
 
-typedef GoogMap<Hash256, const uint8_t*, Hash256Hasher, Hash256Equal>::Map TXMap;
-typedef GoogMap<Hash256,         Block*, Hash256Hasher, Hash256Equal>::Map BlockMap;
+struct MapScan
+{
+    bool                      done;
+    uint64_t                  start;
+    const uint8_t             *end;
+    char                      reason[128];
+    std::vector<ScannedBlock> blocks;
+    const BlockIndexEntry     *indexed;
+    uint64_t                  nbIndexed;
+    uint64_t                  firstIndexed;
+};
+
+struct FoundBlock
+{
+    Block         *block;
+    const uint8_t *hash;
+    uint32_t      fileId;
+};
+
+typedef HashTable<const uint8_t*,  kSHA256ByteSize> TXMap;
+typedef HashTable<Block*,          kSHA256ByteSize> BlockMap;
+typedef HashTable<UTXO*,           kSHA256ByteSize> UTXOMap;
+typedef HashTable<const uint32_t*, kSHA256ByteSize> OutputTableMap;
+
+// Rough TX density of blk files, used to presize TX tables
+static const double kTXPerByte = (3976774.0 / 1713189944.0);
 
-static bool gNeedTXHash;
+bool gNeedTXHash;
+static bool gUseTXStore;
+bool gUseUTXO;
+static bool gPacked;
+static std::string gPackDir;
 static Callback *gCallback;
+static optparse::OptionParser gOptions;
 
-static const Map *gCurMap;
-static std::vector<Map> mapVec;
+static const BlockFile *gCurMap;
+static BlockSource *gSource;
+static uint64_t gReadAhead;
+static bool gAdviseAhead;
+static uint32_t gAdvisedMap;
+static uint64_t gAdvisedEnd;
+static std::vector<BlockFile> mapVec;
 
 static TXMap gTXMap;
 static BlockMap gBlockMap;
-static uint8_t empty[kSHA256ByteSize] = { 0x42 };
 
 static Block *gMaxBlock;
-static Block *gNullBlock;
-static uint64_t gChainSize;
+Block *gNullBlock;
+uint64_t gChainSize;
 static uint64_t gMaxHeight;
 static uint256_t gNullHash;
 
-#define DO(x) x
-    static inline void   startBlock(const uint8_t *p)                      { DO(gCallback->startBlock(p));    }
-    static inline void     endBlock(const uint8_t *p)                      { DO(gCallback->endBlock(p));      }
-    static inline void      startTX(const uint8_t *p, const uint8_t *hash) { DO(gCallback->startTX(p, hash)); }
-    static inline void        endTX(const uint8_t *p)                      { DO(gCallback->endTX(p));         }
-    static inline void  startInputs(const uint8_t *p)                      { DO(gCallback->startInputs(p));   }
-    static inline void    endInputs(const uint8_t *p)                      { DO(gCallback->endInputs(p));     }
-    static inline void   startInput(const uint8_t *p)                      { DO(gCallback->startInput(p));    }
-    static inline void     endInput(const uint8_t *p)                      { DO(gCallback->endInput(p));      }
-    static inline void startOutputs(const uint8_t *p)                      { DO(gCallback->startOutputs(p));  }
-    static inline void   endOutputs(const uint8_t *p)                      { DO(gCallback->endOutputs(p));    }
-    static inline void  startOutput(const uint8_t *p)                      { DO(gCallback->startOutput(p));   }
-    static inline void        start(const Block *s, const Block *e)        { DO(gCallback->start(s, e));      }
-#undef DO
-
-static inline void     startMap(const uint8_t *p) { gCallback->startMap(p);               }
-static inline void       endMap(const uint8_t *p) { gCallback->endMap(p);                 }
-static inline void  startBlock(const Block *b)    { gCallback->startBlock(b, gChainSize); }
-static inline void       endBlock(const Block *b) { gCallback->endBlock(b);               }
-
-static inline void endOutput(
-    const uint8_t *p,
-    uint64_t      value,
+__thread uint32_t gHooks;
+uint32_t gEvents;
+bool gNeedUpTX;
+static int64_t gFromHeight;
+static int64_t gToHeight;
+static int64_t gFromTime;
+static int64_t gToTime;
+static int gNbJobs;
+Block *gFirstBlock;
+Block *gLastBlock;
+Block *gStartBlock;
+
+static bool gRelinkAll;
+static bool gIndexDirty;
+static BlockIndex gBlockIndex;
+static std::string gBlockIndexName;
+static std::vector<FoundBlock> gAllBlocks;
+static std::vector<Block*> gIndexedBlocks;
+static std::vector<BlockIndexFile> gIndexFiles;
+
+static TXStore gTXStore;
+static uint64_t gNbTXEstimate;
+static std::string gTXStoreName;
+static uint64_t gTXStoreHeight;
+static uint32_t gCurFileId;
+static uint32_t gCurHeight;
+__thread const uint8_t *gNextTXHash;
+
+static UTXOMap gUTXOMap;
+static OutputTableMap gOutputTables;
+
+size_t gNextInput;
+std::vector<UpTX> gUpTXs;
+std::vector<const uint8_t*> gUpHashes;
+static uint64_t gUTXOPeak;
+static uint64_t gUTXOBytes;
+static uint64_t gTXHashBytes;
+static uint64_t gOutputTableBytes;
+static std::string gMemJSON;
+static std::string gProfileJSON;
+static bool gHookProfile;
+volatile int gMemStatsRequested;
+static __thread bool gRangeWorker;
+static int gSnapshotEvery;
+static std::string gSnapshotName;
+static UTXOSnapshot gRestored;
+static size_t gNextRelease;
+static std::vector<std::pair<uint64_t, uint32_t> > gReleases;
+
+// Scratch space for the block being parsed, one per thread since height
+// ranges may get parsed in parallel
+struct BlockScratch
+{
+    std::vector<uint32_t> txOffsets;        // Where each TX starts, and where the last one ends
+    std::vector<size_t> sizes;
+    std::vector<uint8_t*> hashes;
+    std::vector<const uint8_t*> txs;
+};
+static __thread BlockScratch *gScratch;
+
+static BlockScratch *blockScratch()
+{
+    if(unlikely(0==gScratch)) gScratch = new BlockScratch;
+    return gScratch;
+}
+
+static inline void   startMap(const uint8_t *p) { gCallback->startMap(p);   }
+static inline void     endMap(const uint8_t *p) { gCallback->endMap(p);     }
+static inline void startBlock(const uint8_t *p) { gCallback->startBlock(p); }
+static inline void   endBlock(const uint8_t *p) { gCallback->endBlock(p);   }
+
+uint32_t *newOutputTable(
     const uint8_t *txHash,
-    uint64_t      outputIndex,
-    const uint8_t *outputScript,
-    uint64_t      outputScriptSize
-)
-{
-    gCallback->endOutput(
-        p,
-        value,
-        txHash,
-        outputIndex,
-        outputScript,
-        outputScriptSize
-    );
+    uint64_t      nbOutputs
+)
+{
+    uint32_t *offsets = (uint32_t*)malloc(nbOutputs*sizeof(uint32_t));
+    if(unlikely(0==offsets)) errFatal("failed to allocate output table");
+    __sync_fetch_and_add(&gOutputTableBytes, nbOutputs*sizeof(uint32_t));
+    gOutputTables[txHash] = offsets;
+    return offsets;
 }
 
-static inline void edge(
-    uint64_t      value,
-    const uint8_t *upTXHash,
-    uint64_t      outputIndex,
-    const uint8_t *outputScript,
-    uint64_t      outputScriptSize,
-    const uint8_t *downTXHash,
-    uint64_t      inputIndex,
-    const uint8_t *inputScript,
-    uint64_t      inputScriptSize
-)
-{
-    gCallback->edge(
-        value,
-        upTXHash,
-        outputIndex,
-        outputScript,
-        outputScriptSize,
-        downTXHash,
-        inputIndex,
-        inputScript,
-        inputScriptSize
-    );
+const uint32_t *findOutputTable(
+    const uint8_t *txHash
+)
+{
+    auto i = gOutputTables.find(txHash);
+    if(unlikely(gOutputTables.end()==i)) return 0;
+    return i->second;
 }
 
-template<
-    bool skip,
-    bool fullContext
->
-static void parseOutput(
-    const uint8_t *&p,
-    const uint8_t *txHash,
-    uint64_t      outputIndex,
-    const uint8_t *downTXHash,
-    uint64_t      downInputIndex,
-    const uint8_t *downInputScript,
-    uint64_t      downInputScriptSize,
-    bool          found = false
+static UTXO *buildUTXO(
+    const uint8_t *p
 )
 {
-    if(!skip && !fullContext) startOutput(p);
+    const uint8_t *outputs = p;
+    uint64_t nbScriptBytes = 0;
+
+    LOAD_VARINT(nbOutputs, p);
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+        SKIP(uint64_t, value, p);
+        LOAD_VARINT(outputScriptSize, p);
+        nbScriptBytes += outputScriptSize;
+        p += outputScriptSize;
+    }
+
+    size_t size = sizeof(UTXO) + nbOutputs*sizeof(UTXOOutput) + nbScriptBytes;
+    UTXO *utxo = (UTXO*)malloc(size);
+    if(unlikely(0==utxo)) errFatal("failed to allocate UTXO");
+
+    UTXOOutput *utxoOutputs = (UTXOOutput*)(1 + utxo);
+    uint8_t *scripts = (uint8_t*)(nbOutputs + utxoOutputs);
+    utxo->nbOutputs = nbOutputs;
+    utxo->nbUnspent = 0;
+
+    p = outputs;
+    uint32_t scriptOffset = 0;
+    loadVarInt(p);
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
 
         LOAD(uint64_t, value, p);
         LOAD_VARINT(outputScriptSize, p);
+        memcpy(scriptOffset + scripts, p, outputScriptSize);
 
-        const uint8_t *outputScript = p;
+        UTXOOutput &output = utxoOutputs[outputIndex];
+        output.value = value;
+        output.scriptOffset = scriptOffset;
+        output.scriptSize = outputScriptSize;
+
+        if(!isUnspendable(p, outputScriptSize)) ++(utxo->nbUnspent);
+        scriptOffset += outputScriptSize;
         p += outputScriptSize;
+    }
+    return utxo;
+}
 
-        if(!skip && fullContext && found) {
-            edge(
-                value,
-                txHash,
-                outputIndex,
-                outputScript,
-                outputScriptSize,
-                downTXHash,
-                downInputIndex,
-                downInputScript,
-                downInputScriptSize
-            );
-        }
+static uint32_t utxoSize(
+    const UTXO *utxo
+)
+{
+    uint32_t nbScriptBytes = 0;
+    const UTXOOutput *outputs = (const UTXOOutput*)(1 + utxo);
+    if(0<utxo->nbOutputs) {
+        const UTXOOutput &last = outputs[utxo->nbOutputs - 1];
+        nbScriptBytes = last.scriptOffset + last.scriptSize;
+    }
+    return sizeof(UTXO) + utxo->nbOutputs*sizeof(UTXOOutput) + nbScriptBytes;
+}
+
+static void addUTXO(
+    const uint8_t *txHash,
+    const uint8_t *outputs
+)
+{
+    UTXO *utxo = buildUTXO(outputs);
+    if(unlikely(0==utxo->nbUnspent)) {
+        free(utxo);
+        return;
+    }
 
-    if(!skip && !fullContext) {
-        endOutput(
-            p,
-            value,
-            txHash,
-            outputIndex,
-            outputScript,
-            outputScriptSize
+    __sync_fetch_and_add(&gUTXOBytes, utxoSize(utxo));
+
+    auto i = gUTXOMap.find(txHash);
+    if(unlikely(gUTXOMap.end()!=i)) {
+        __sync_fetch_and_sub(&gUTXOBytes, utxoSize(i->second));
+        free(i->second);
+        i->second = utxo;
+        return;
+    }
+
+    gUTXOMap[txHash] = utxo;
+    if(unlikely(gUTXOPeak<gUTXOMap.size())) gUTXOPeak = gUTXOMap.size();
+}
+
+static std::string snapshotName(
+    int64_t height
+)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), ".%" PRId64, height);
+    return gSnapshotName + buf;
+}
+
+// Save the UTXO set as it stands right after a block, unless a snapshot of
+// that very block is already there
+static void saveSnapshot(
+    const Block   *block,
+    const uint8_t *blockHash
+)
+{
+    std::string path = snapshotName(block->height);
+    {
+        UTXOSnapshot existing;
+        bool loaded = existing.load(path);
+        if(loaded && 0==memcmp(blockHash, existing.blockHash(), kSHA256ByteSize)) return;
+    }
+
+    UTXOSnapshot snapshot;
+    if(!snapshot.create(path, block->height, blockHash)) return;
+
+    auto e = gUTXOMap.end();
+    auto i = gUTXOMap.begin();
+    while(i!=e) {
+        const UTXO *utxo = i->second;
+        snapshot.add(i->first, utxo, utxoSize(utxo));
+        ++i;
+    }
+
+    if(snapshot.commit()) {
+        info(
+            "UTXO snapshot at height %" PRId64 ": %" PRIu64 " transactions with unspent outputs",
+            block->height,
+            (uint64_t)gUTXOMap.size()
         );
     }
 }
 
-template<
-    bool skip,
-    bool fullContext
->
-static void parseOutputs(
-    const uint8_t *&p,
+// Evict the UTXO of a TX once the last of its spendable outputs is spent
+void dropUTXO(
     const uint8_t *txHash,
-    uint64_t      stopAtIndex = -1,
-    const uint8_t *downTXHash = 0,
-    uint64_t      downInputIndex = 0,
-    const uint8_t *downInputScript = 0,
-    uint64_t      downInputScriptSize = 0
+    UTXO          *utxo
+)
+{
+    gUTXOMap.erase(txHash);
+    __sync_fetch_and_sub(&gUTXOBytes, utxoSize(utxo));
+    free(utxo);
+}
+
+bool findUpTX(
+    const uint8_t *upTXHash,
+    UpTX          &up
 )
 {
-    if(!skip && !fullContext) startOutputs(p);
+    up.outputs = 0;
+    up.utxo = 0;
+
+    if(gUseUTXO) {
+        auto i = gUTXOMap.find(upTXHash);
+        if(unlikely(gUTXOMap.end()==i)) return false;
+        up.utxo = i->second;
+        return true;
+    }
+
+    if(gUseTXStore) {
+        TXLocation location;
+        bool found = gTXStore.find(upTXHash, location);
+        if(unlikely(!found)) return false;
+
+        bool inFile = (
+            location.fileId<mapVec.size()                   &&
+            location.offset<mapVec[location.fileId].size
+        );
+        if(unlikely(!inFile)) errFatal("TX store points past the end of a blk file, remove %s.tx* and run again", gTXStoreName.c_str());
+        up.outputs = location.offset + mapVec[location.fileId].p;
+        return true;
+    }
+
+    auto i = gTXMap.find(upTXHash);
+    if(unlikely(gTXMap.end()==i)) return false;
+    up.outputs = i->second;
+    return true;
+}
+
+static void prefetchGroup(
+    const uint8_t *upTXHash
+)
+{
+         if(gUseUTXO)    gUTXOMap.prefetchGroup(upTXHash);
+    else if(gUseTXStore) gTXStore.prefetch(upTXHash);
+    else                 gTXMap.prefetchGroup(upTXHash);
+}
+
+static void prefetchKeys(
+    const uint8_t *upTXHash
+)
+{
+         if(gUseUTXO)    gUTXOMap.prefetchKeys(upTXHash);
+    else if(gUseTXStore) return;
+    else                 gTXMap.prefetchKeys(upTXHash);
+}
+
+// One pass over a block's TXs, ahead of the callback walk: records where
+// each TX starts and ends, for hashing, and the upstream TX hash of each
+// input, for lookups
+static void scanTXs(
+    const uint8_t               *p,
+    uint64_t                    nbTX,
+    BlockScratch                &scratch,
+    std::vector<const uint8_t*> &upHashes
+)
+{
+    const uint8_t *first = p;
+    std::vector<uint32_t> &txOffsets = scratch.txOffsets;
+    txOffsets.resize(1 + nbTX);
+    if(gNeedUpTX) upHashes.clear();
+    for(uint64_t txIndex=0; txIndex<nbTX; ++txIndex) {
+
+        txOffsets[txIndex] = p - first;
+        SKIP(uint32_t, version, p);
+        SKIP(uint32_t, ntime, p);
+
+        LOAD_VARINT(nbInputs, p);
+        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex) {
+            bool isGenTX = (0==memcmp(gNullHash.v, p, sizeof(gNullHash)));
+            if(gNeedUpTX) upHashes.push_back(isGenTX ? 0 : p);
+            SKIP(uint256_t, upTXHash, p);
+            SKIP(uint32_t, upOutputIndex, p);
+            LOAD_VARINT(inputScriptSize, p);
+            p += inputScriptSize;
+            SKIP(uint32_t, sequence, p);
+        }
 
         LOAD_VARINT(nbOutputs, p);
         for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
-            bool found = fullContext && !skip && (stopAtIndex==outputIndex);
-            parseOutput<skip, fullContext>(
-                p,
-                txHash,
-                outputIndex,
-                downTXHash,
-                downInputIndex,
-                downInputScript,
-                downInputScriptSize,
-                found
-            );
-            if(found) break;
+            SKIP(uint64_t, value, p);
+            LOAD_VARINT(outputScriptSize, p);
+            p += outputScriptSize;
         }
 
-    if(!skip && !fullContext) endOutputs(p);
+        SKIP(uint32_t, lockTime, p);
+    }
+    txOffsets[nbTX] = p - first;
 }
 
-template<
-    bool skip
->
-static void parseInput(
-    const uint8_t *&p,
+// Look up the upstream TX of every input of a block before parsing it. Each
+// window of inputs goes through all its hash table misses at once rather
+// than one input at a time. Inputs spending a TX of the same block are not
+// found yet, and get resolved when parsed
+static void resolveInputs()
+{
+    ProfileTimer timer(kProfileTXLookup);
+    gNextInput = 0;
+    size_t nbInputs = gUpHashes.size();
+    profileCount(kProfileTXLookup, 0, 0, 0, nbInputs);
+    gUpTXs.resize(nbInputs);
+
+    const uint8_t **hashes = gUpHashes.data();
+    for(size_t start=0; start<nbInputs; start+=kPrefetchWindow) {
+
+        size_t end = start + kPrefetchWindow;
+        if(nbInputs<end) end = nbInputs;
+
+        for(size_t i=start; i<end; ++i) if(hashes[i]) prefetchGroup(hashes[i]);
+        for(size_t i=start; i<end; ++i) if(hashes[i]) prefetchKeys(hashes[i]);
+        for(size_t i=start; i<end; ++i) {
+            UpTX &up = gUpTXs[i];
+            up.outputs = 0;
+            up.utxo = 0;
+            if(hashes[i]) findUpTX(hashes[i], up);
+        }
+    }
+}
+
+// Record where the outputs of a TX are, for inputs downstream to find them,
+// once the TX's own inputs are resolved
+void addTX(
     const uint8_t *txHash,
-    uint64_t      inputIndex
+    const uint8_t *outputs
 )
 {
-    if(!skip) startInput(p);
+    ProfileTimer timer(kProfileTXInsert);
+    if(gUseUTXO) {
+        addUTXO(txHash, outputs);
+    } else if(!gUseTXStore) {
+        gTXMap[txHash] = outputs;
+    }
+    if(gUseTXStore && gTXStoreHeight<gCurHeight) {
+        TXLocation location;
+        location.fileId = gCurFileId;
+        location.height = gCurHeight;
+        location.offset = outputs - mapVec[gCurFileId].p;
+        gTXStore.add(txHash, location);
+    }
+}
 
-        const uint8_t *upTXHash = p;
-        const uint8_t *upTXOutputs = 0;
-        
-        if(gNeedTXHash && !skip) {
-            bool isGenTX = (0==memcmp(gNullHash.v, upTXHash, sizeof(gNullHash)));
-            if(likely(false==isGenTX)) {
-                auto i = gTXMap.find(upTXHash);
-                if(unlikely(gTXMap.end()==i))
-                    errFatal("failed to locate upstream TX");
-                upTXOutputs = i->second;
-            }
-        }
-        
-        SKIP(uint256_t, dummyUpTXhash, p);
-        LOAD(uint32_t, upOutputIndex, p);
-        LOAD_VARINT(inputScriptSize, p);
-
-        if(!skip && 0!=upTXOutputs) {
-            const uint8_t *inputScript = p;
-            parseOutputs<false, true>(
-                upTXOutputs,
-                upTXHash,
-                upOutputIndex,
-                txHash,
-                inputIndex,
-                inputScript,
-                inputScriptSize
-            );
-        }
+// Hash all TX of a block, as found by scanTXs, in one batch so that SIMD
+// engines can hash several of them at once. Callbacks may hold on to TX
+// hashes: they are never freed
+static const uint8_t *hashTXs(
+    const uint8_t *p,
+    uint64_t      nbTX,
+    BlockScratch  &scratch
+)
+{
+    std::vector<uint32_t> &txOffsets = scratch.txOffsets;
+    std::vector<size_t> &sizes = scratch.sizes;
+    std::vector<uint8_t*> &hashes = scratch.hashes;
+    std::vector<const uint8_t*> &txs = scratch.txs;
+
+    ProfileTimer timer(kProfileHashTX);
+    profileCount(kProfileHashTX, txOffsets[nbTX], 0, nbTX, 0);
+
+    uint8_t *result = (uint8_t*)malloc(nbTX*kSHA256ByteSize);
+    if(unlikely(0==result)) errFatal("failed to allocate TX hashes");
+    __sync_fetch_and_add(&gTXHashBytes, nbTX*kSHA256ByteSize);
+
+    sizes.resize(nbTX);
+    hashes.resize(nbTX);
+    txs.resize(nbTX);
+    for(uint64_t txIndex=0; txIndex<nbTX; ++txIndex) {
+        txs[txIndex] = txOffsets[txIndex] + p;
+        sizes[txIndex] = txOffsets[txIndex+1] - txOffsets[txIndex];
+        hashes[txIndex] = txIndex*kSHA256ByteSize + result;
+    }
+
+    sha256dBatch(hashes.data(), txs.data(), sizes.data(), nbTX);
+    return result;
+}
+
+static uint32_t fileIdOf(
+    const uint8_t *p
+)
+{
+    static uint32_t last = 0;
+    const BlockFile *map = &mapVec[last];
+    if(likely(map->p<=p && p<(map->size + map->p))) return last;
+
+    for(uint32_t i=0; i<mapVec.size(); ++i) {
+        map = &mapVec[i];
+        if(map->p<=p && p<(map->size + map->p)) return (last = i);
+    }
+
+    errFatal("block is not in any blk file");
+    return 0;
+}
+
+// In UTXO mode, nothing points back into a blk file once the last of its
+// longest-chain blocks is parsed: find the height at which that happens
+static void planReleases()
+{
+    // A repacked chain gets parsed front to back whatever the mode
+    if(gPacked) {
+        for(uint32_t i=0; i<mapVec.size(); ++i)
+            gSource->access(mapVec[i], 0, -1, BlockSource::kSequential);
+    }
 
-        p += inputScriptSize;
-        SKIP(uint32_t, sequence, p);
+    if(!gUseUTXO) return;
 
-    if(!skip) endInput(p);
+    std::vector<uint64_t> lastHeight(mapVec.size(), 0);
+    const Block *block = gNullBlock->next;
+    while(likely(0!=block)) {
+        lastHeight[fileIdOf(block->data)] = block->height;
+        block = block->next;
+    }
+
+    // Nothing looks back into a file, so the kernel may also read ahead hard
+    for(uint32_t i=0; i<mapVec.size(); ++i) {
+        gReleases.push_back(std::make_pair(lastHeight[i], i));
+        gSource->access(mapVec[i], 0, -1, BlockSource::kSequential);
+    }
+    std::sort(gReleases.begin(), gReleases.end());
 }
 
-template<
-    bool skip
->
-static void parseInputs(
-    const uint8_t *&p,
-    const uint8_t *txHash
+// Drop the pages of blk files the parse is done with. The mappings stay, so
+// pointers callbacks kept into them remain valid and just fault back in
+static void releaseMaps(
+    uint64_t height
 )
 {
-    if(!skip) startInputs(p);
+    while(gNextRelease<gReleases.size()) {
 
-        LOAD_VARINT(nbInputs, p);
-        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex)
-            parseInput<skip>(p, txHash, inputIndex);
+        const std::pair<uint64_t, uint32_t> &release = gReleases[gNextRelease];
+        if(height<release.first) break;
 
-    if(!skip) endInputs(p);
+        gSource->release(mapVec[release.second], 0, -1);
+        ++gNextRelease;
+    }
 }
 
-template<
-    bool skip
->
-static void parseTX(
-    const uint8_t *&p
+// Have the block source get in what the serial parse gets to next:
+// --readAhead bytes past the current block, running over into the next blk
+// file. Only done again once the parse is half way through the last window,
+// when what the parse is past gets retired
+static void adviseAhead(
+    const Block *block
 )
 {
-    uint8_t *txHash = 0;
-    const uint8_t *txStart = p;
+    uint32_t fileId = fileIdOf(block->data);
+    const BlockFile &map = mapVec[fileId];
+    uint64_t offset = block->data - map.p;
+    uint64_t target = offset + gReadAhead;
+
+    bool sameMap = (fileId==gAdvisedMap);
+    if(!sameMap || gAdvisedEnd + gReadAhead/2<=target) {
+
+        if(sameMap) gSource->retire(map, 0, offset);
+        else if(gAdvisedMap<mapVec.size()) gSource->retire(mapVec[gAdvisedMap], 0, -1);
+
+        uint64_t start = (sameMap && offset<gAdvisedEnd) ? gAdvisedEnd : offset;
+        gSource->willNeed(map, start, target);
+        if(map.size<target && fileId + 1<mapVec.size()) {
+            gSource->willNeed(mapVec[fileId + 1], 0, target - map.size);
+        }
 
-    if(gNeedTXHash && !skip) {
-        const uint8_t *txEnd = p;
-        parseTX<true>(txEnd);
-        txHash = allocHash256();
-        sha256Twice(txHash, txStart, txEnd - txStart);
+        gAdvisedMap = fileId;
+        gAdvisedEnd = target;
     }
 
-    if(!skip) startTX(p, txHash);
+    uint32_t size;
+    memcpy(&size, block->data - 4, sizeof(size));
+    gSource->wait(map, offset + size);
+}
 
-        SKIP(uint32_t, version, p);
-        SKIP(uint32_t, ntime, p);
+// Boundary scan and TX hashing of one block, run ahead of the parse
+struct BlockTask:public Task
+{
+    const Block                 *block;
+    bool                        stored;         // TX hashes come from the store, only scan
+    bool                        done;
+    BlockScratch                scratch;
+    std::vector<const uint8_t*> upHashes;
+    const uint8_t               *hashes;
+
+    virtual void run();
+};
 
-        parseInputs<skip>(p, txHash);
+static TaskPool *gPrepPool;
+static std::vector<BlockTask> gPrepWindow;
+static const Block *gNextPrep;
+static uint64_t gNbPrepScheduled;
+static uint64_t gNbPrepRetired;
+static boost::mutex gPrepMutex;
+static boost::condition_variable gPrepCond;
 
-        if(gNeedTXHash && !skip)
-            gTXMap[txHash] = p;
+void BlockTask::run()
+{
+    const uint8_t *p = 80 + block->data;
+    LOAD_VARINT(nbTX, p);
+    scanTXs(p, nbTX, scratch, upHashes);
+    hashes = stored ? 0 : hashTXs(p, nbTX, scratch);
+
+    boost::lock_guard<boost::mutex> lock(gPrepMutex);
+    done = true;
+    gPrepCond.notify_all();
+}
 
-        parseOutputs<skip, false>(p, txHash);
+static void schedulePrep(
+    BlockTask &task
+)
+{
+    if(0==gNextPrep) return;
 
-        SKIP(uint32_t, lockTime, p);
+    task.block = gNextPrep;
+    task.stored = (gUseTXStore && (uint64_t)gNextPrep->height<=gTXStoreHeight);
+    task.done = false;
+    gNextPrep = (gLastBlock==gNextPrep) ? 0 : gNextPrep->next;
 
-    if(!skip) endTX(p);
+    ++gNbPrepScheduled;
+    gPrepPool->push(&task);
+}
+
+// The serial second pass gets the boundary scan and TX hashing of the blocks
+// ahead of it done out of order on a task pool. Finished blocks retire to
+// enterBlock strictly in chain order, through a window that doubles as the
+// reorder buffer: a retired slot gets the next block past the window
+static void startPrep()
+{
+    if(!gNeedTXHash || gNbJobs<2) return;
+
+    gPrepPool = new TaskPool(gNbJobs);
+    gPrepWindow.resize(4*gNbJobs);
+    gNextPrep = gStartBlock;
+    gNbPrepScheduled = 0;
+    gNbPrepRetired = 0;
+    for(size_t i=0; i<gPrepWindow.size(); ++i) schedulePrep(gPrepWindow[i]);
 }
 
-static void parseBlock(
+// Whatever got scheduled past a stop() still runs, then goes to waste
+static void stopPrep()
+{
+    if(0==gPrepPool) return;
+
+    delete gPrepPool;
+    gPrepPool = 0;
+    std::vector<BlockTask>().swap(gPrepWindow);
+}
+
+static BlockTask *retirePrep(
     const Block *block
 )
 {
-    startBlock(block);
+    if(0==gPrepPool || gNbPrepScheduled<=gNbPrepRetired) return 0;
 
-        const uint8_t *p = block->data;
-        const uint8_t *header = p;
-        SKIP(uint32_t, version, p);
-        SKIP(uint256_t, prevBlkHash, p);
-        SKIP(uint256_t, blkMerkleRoot, p);
-        SKIP(uint32_t, blkTime, p);
-        SKIP(uint32_t, blkBits, p);
-        SKIP(uint32_t, blkNonce, p);
-        LOAD_VARINT(nbTX, p);
-        for(uint64_t txIndex=0; likely(txIndex<nbTX); ++txIndex)
-            parseTX<false>(p);
+    BlockTask &task = gPrepWindow[gNbPrepRetired % gPrepWindow.size()];
+    if(unlikely(block!=task.block)) return 0;
 
-    endBlock(block);
+    boost::unique_lock<boost::mutex> lock(gPrepMutex);
+    while(!task.done) gPrepCond.wait(lock);
+    return &task;
 }
 
-static void parseLongestChain()
+// Get a block's TX hashes and upstream TXs ready before hooks see its TXs
+void enterBlock(
+    const Block   *block,
+    const uint8_t *txs,
+    uint64_t      nbTX
+)
 {
-    Block *blk = gNullBlock->next;
+    if(gUseTXStore) {
+        gCurHeight = block->height;
+        gCurFileId = fileIdOf(block->data);
+    }
 
-    start(blk, gMaxBlock);
-    while(likely(0!=blk)) {
-        parseBlock(blk);
-        blk = blk->next;
+    if(gAdviseAhead) adviseAhead(block);
+
+    if(gNeedTXHash) {
+        bool stored = (gUseTXStore && gCurHeight<=gTXStoreHeight);
+        BlockTask *task = retirePrep(block);
+        if(task) {
+            gNextTXHash = stored ? gTXStore.txHashes(gCurHeight) : task->hashes;
+            if(gNeedUpTX) gUpHashes.swap(task->upHashes);
+            ++gNbPrepRetired;
+            schedulePrep(*task);
+        } else {
+            BlockScratch &scratch = *blockScratch();
+            scanTXs(txs, nbTX, scratch, gUpHashes);
+            gNextTXHash = stored ? gTXStore.txHashes(gCurHeight) : hashTXs(txs, nbTX, scratch);
+        }
+        if(gNeedUpTX) resolveInputs();
     }
 }
 
-static void findLongestChain()
+void leaveBlock(
+    const Block   *block,
+    const uint8_t *header,
+    uint64_t      nbTX
+)
 {
-    Block *block = gMaxBlock;
+    bool addToStore = (gUseTXStore && gTXStoreHeight<gCurHeight);
+    bool snapshot = (gUseUTXO && 0<gSnapshotEvery && 0==(block->height % gSnapshotEvery));
+    if(addToStore || snapshot) {
+        uint8_t hash[kSHA256ByteSize];
+        sha256Twice(hash, header, 80);
+        if(addToStore) gTXStore.addBlock(hash, nbTX, gCurFileId, block->data - mapVec[gCurFileId].p);
+        if(snapshot) saveSnapshot(block, hash);
+    }
+
+    if(gUseUTXO) releaseMaps(block->height);
+}
+
+// One height range of a parallel second pass, with the part of the command it feeds
+struct RangeParse
+{
+    const Block *first;
+    const Block *last;
+    Callback    *part;
+    bool        done;
+};
+
+static boost::mutex gRangeMutex;
+static boost::condition_variable gRangeCond;
+
+static void rangeWorker(
+    std::vector<RangeParse> *ranges,
+    size_t                  *nextRange
+)
+{
+    gRangeWorker = true;
+    while(1) {
+
+        size_t i = __sync_fetch_and_add(nextRange, 1);
+        if(unlikely(ranges->size()<=i)) break;
+
+        RangeParse &range = (*ranges)[i];
+        range.part->parseRange(range.first, range.last);
+
+        boost::lock_guard<boost::mutex> lock(gRangeMutex);
+        range.done = true;
+        gRangeCond.notify_all();
+    }
+
+    delete gScratch;
+    gScratch = 0;
+}
+
+// Commands that fork get the chain cut into height ranges of about the same
+// byte size, parsed by worker threads, while the main thread merges finished
+// parts back into the command in height order. Not for commands that want
+// edges: inputs need the upstream TXs of every range before theirs
+static bool parseRanges()
+{
+    if(gNeedUpTX || gNbJobs<2) return false;
+
+    Callback *part = gCallback->fork();
+    if(0==part) return false;
+
+    size_t nbThreads = gNbJobs;
+    uint64_t rangeSize = 1 + gChainSize/(8*nbThreads);
+
+    RangeParse range;
+    range.first = gFirstBlock;
+    range.part = part;
+    range.done = false;
+
+    uint64_t size = 0;
+    std::vector<RangeParse> ranges;
+    const Block *block = gFirstBlock;
     while(1) {
 
-        if(likely(0!=block->data)) {
-            const uint8_t *p = -4 + (block->data);
-            LOAD(uint32_t, size, p);
-            gChainSize += size;
+        const uint8_t *p = -4 + (block->data);
+        LOAD(uint32_t, blockSize, p);
+        size += blockSize;
+
+        bool last = (gLastBlock==block);
+        if(rangeSize<=size || last) {
+            range.last = block;
+            if(0==range.part) range.part = gCallback->fork();
+            ranges.push_back(range);
+            range.first = block->next;
+            range.part = 0;
+            size = 0;
         }
 
+        if(last) break;
+        block = block->next;
+    }
+    if(ranges.size()<nbThreads) nbThreads = ranges.size();
+
+    info(
+        "parsing %" PRIu64 " height ranges on %" PRIu64 " threads",
+        (uint64_t)ranges.size(),
+        (uint64_t)nbThreads
+    );
+
+    gCallback->start(gFirstBlock, gLastBlock);
+
+    size_t nextRange = 0;
+    boost::thread_group workers;
+    for(size_t t=0; t<nbThreads; ++t)
+        workers.add_thread(new boost::thread(rangeWorker, &ranges, &nextRange));
+
+    for(size_t i=0; i<ranges.size(); ++i) {
+
+        RangeParse &range = ranges[i];
+        {
+            boost::unique_lock<boost::mutex> lock(gRangeMutex);
+            while(!range.done) gRangeCond.wait(lock);
+        }
+
+        gCallback->merge(range.part);
+        delete range.part;
+    }
+
+    workers.join_all();
+    if(unlikely(gMemStatsRequested)) pollMemStats();
+    return true;
+}
+
+static void parseLongestChain()
+{
+    ProfileTimer timer(kProfileSecondPass);
+    if(unlikely(0==gFirstBlock)) {
+        warning("no block of the longest chain falls within the requested range");
+        return;
+    }
+
+    if(!parseRanges()) {
+        startPrep();
+        gAdviseAhead = (0<gReadAhead);
+        gAdvisedMap = -1;
+            gCallback->parseChain();
+        gAdviseAhead = false;
+        stopPrep();
+    }
+
+    if(gUseUTXO) {
+        info(
+            "UTXO set: %" PRIu64 " transactions with unspent outputs, peak %" PRIu64,
+            (uint64_t)gUTXOMap.size(),
+            gUTXOPeak
+        );
+    }
+}
+
+static void findLongestChain()
+{
+    ProfileTimer timer(kProfileLongestChain);
+    uint64_t nbBlocks = 0;
+    Block *block = gMaxBlock;
+    while(1) {
         Block *prev = block->prev;
         if(unlikely(0==prev)) break;
         prev->next = block;
         block = prev;
+        ++nbBlocks;
+    }
+    profileCount(kProfileLongestChain, 0, nbBlocks, 0, 0);
+}
+
+// Narrow the second pass down to the blocks of the longest chain within
+// --from/--to or --since/--until
+static void findRange()
+{
+    Block *block = gNullBlock->next;
+    while(likely(0!=block)) {
+
+        const uint8_t *p = 68 + (block->data);
+        LOAD(uint32_t, blkTime, p);
+        if(0<=gToHeight && gToHeight<block->height) break;
+        if(0<=gToTime && gToTime<(int64_t)blkTime) break;
+
+        bool inRange = (gFromHeight<=block->height && gFromTime<=(int64_t)blkTime);
+        if(0==gFirstBlock && inRange) gFirstBlock = block;
+        if(0!=gFirstBlock) gLastBlock = block;
+        block = block->next;
     }
+    if(0==gFirstBlock) return;
+
+    // Blocks ahead of the range only matter if later inputs may spend their
+    // outputs: they are then parsed, but callbacks don't get to see them
+    gStartBlock = gNeedUpTX ? gNullBlock->next : gFirstBlock;
+
+    // Callbacks see progress against the range, the TX map only grows as
+    // far as the blocks actually parsed
+    uint64_t parsedSize = 0;
+    block = gNullBlock->next;
+    while(1) {
+
+        const uint8_t *p = -4 + (block->data);
+        LOAD(uint32_t, size, p);
+        if(gFirstBlock->height<=block->height) gChainSize += size;
+        parsedSize += size;
+
+        if(gLastBlock==block) break;
+        block = block->next;
+    }
+
+    if(!gNeedUpTX) parsedSize = gChainSize;
+    if(gNeedUpTX && !gUseTXStore && !gUseUTXO) gTXMap.resize(1.5 * kTXPerByte * parsedSize);
+}
+
+// Find how much of the longest chain the TX store covers, and drop whatever
+// it holds past the point where the chain forked away from it
+static void openTXStore()
+{
+    if(!gUseTXStore) return;
+    if(!gNeedUpTX) {
+        gUseTXStore = false;
+        return;
+    }
+
+    gTXStore.open(gTXStoreName, gNbTXEstimate);
+
+    uint64_t height = gTXStore.nbBlocks();
+    if(gMaxHeight<height) height = gMaxHeight;
+
+    const Block *block = gMaxBlock;
+    while(block && height<(uint64_t)block->height) block = block->prev;
+
+    // Stored TX locations are offsets into blk files, which get rewritten
+    // (reindex, pruned re-download) with the very same blocks landing
+    // elsewhere: keep the stored blocks up to the first one that is not
+    // what the chain has at its height, or not where it was
+    uint64_t keep = height;
+    while(0<height) {
+
+        uint8_t hash[kSHA256ByteSize];
+        sha256Twice(hash, block->data, 80);
+
+        uint32_t fileId = fileIdOf(block->data);
+        TXLocation stored = gTXStore.blockLocation(height);
+        bool same = (
+            0==memcmp(hash, gTXStore.blockHash(height), kSHA256ByteSize)   &&
+            fileId==stored.fileId                                           &&
+            (uint64_t)(block->data - mapVec[fileId].p)==stored.offset
+        );
+        if(!same) keep = height - 1;
+
+        block = block->prev;
+        --height;
+    }
+
+    if(keep<gTXStore.nbBlocks()) {
+        info("TX store: dropping blocks past height %" PRIu64, keep);
+        gTXStore.truncate(keep);
+    }
+    gTXStoreHeight = keep;
+}
+
+// Start the parse right at the range when a snapshot of the UTXO set as it
+// stood past the block ahead of it is around, rather than parse everything
+// up to there. The TX store has to see every block though: it must already
+// cover that far
+static void restoreSnapshot()
+{
+    if(!gUseUTXO || 0==gFirstBlock) return;
+
+    const Block *prev = gFirstBlock->prev;
+    if(gNullBlock==prev) return;
+    if(gUseTXStore && gTXStoreHeight<(uint64_t)prev->height) return;
+
+    std::string path = snapshotName(prev->height);
+    if(!gRestored.load(path)) return;
+
+    uint8_t hash[kSHA256ByteSize];
+    sha256Twice(hash, prev->data, 80);
+    if(0!=memcmp(hash, gRestored.blockHash(), kSHA256ByteSize)) {
+        warning("ignoring UTXO snapshot %s: the longest chain no longer goes through its block", path.c_str());
+        gRestored.unload();
+        return;
+    }
+
+    gUTXOMap.resize(gRestored.nbUTXO());
+
+    uint32_t size;
+    const uint8_t *txHash;
+    const uint8_t *data;
+    while(gRestored.next(txHash, data, size)) {
+        UTXO *utxo = (UTXO*)malloc(size);
+        if(unlikely(0==utxo)) errFatal("failed to allocate UTXO");
+        memcpy(utxo, data, size);
+        gUTXOMap[txHash] = utxo;
+        gUTXOBytes += size;
+    }
+    gUTXOPeak = gUTXOMap.size();
+    gStartBlock = gFirstBlock;
+
+    info(
+        "restored %" PRIu64 " transactions with unspent outputs from UTXO snapshot at height %" PRId64,
+        (uint64_t)gUTXOMap.size(),
+        prev->height
+    );
+}
+
+// Reports get printed from the parse loops: structures are consistent there
+static void requestMemStats(
+    int
+)
+{
+    gMemStatsRequested = 1;
+}
+
+static void initOptions(
+    int   &argc,
+    char **argv
+)
+{
+    gOptions
+        .usage("[parser options] <command> [command options] [command arguments]")
+        .version("")
+        .description("parse the blockchain and run <command> on it")
+        .add_help_option(false)
+        .disable_interspersed_args()
+        .epilog("")
+    ;
+    gOptions
+        .add_option("--txStore")
+        .action("store_true")
+        .set_default(false)
+        .help("keep TX hashes and locations on disk, so later runs skip re-hashing and re-indexing transactions")
+    ;
+    gOptions
+        .add_option("--utxo")
+        .action("store_true")
+        .set_default(false)
+        .help("resolve inputs from a compact set of unspent outputs instead of every TX ever seen, and release blk files once parsed")
+    ;
+    gOptions
+        .add_option("--packed")
+        .action("store_true")
+        .set_default(false)
+        .help("read the chain the repack command wrote to ~/.SonicScrewdriver/packed instead of the blk files")
+    ;
+    gOptions
+        .add_option("--jobs")
+        .action("store")
+        .type("int")
+        .set_default(0)
+        .help("run up to <n> threads: height ranges for commands whose results merge, else block scans and TX hashing ahead of the parse (default: one per CPU)")
+    ;
+    gOptions
+        .add_option("--snapshotEvery")
+        .action("store")
+        .type("int")
+        .set_default(0)
+        .help("with --utxo, save the UTXO set after every <n>th block, so that later runs with --from right past one start there (default: never)")
+    ;
+    gOptions
+        .add_option("--populate")
+        .action("store_true")
+        .set_default(false)
+        .help("with the mmap source, read every blk file in when mapping it, rather than on first touch of each page")
+    ;
+    gOptions
+        .add_option("--readAhead")
+        .action("store")
+        .type("int")
+        .set_default(64)
+        .help("have the block source read <n> MB of blk files ahead of the parse, 0 to leave it to the kernel's own readahead (default: n=%default)")
+    ;
+    gOptions
+        .add_option("--zstdWindow")
+        .action("store")
+        .type("int")
+        .set_default(256)
+        .help("decompress blkNNNNN.dat.zst archives at most <n> MB ahead of the parse (default: n=%default)")
+    ;
+    gOptions
+        .add_option("--source")
+        .action("store")
+        .set_default("mmap")
+        .help("how blk files get read in: mmap, read (pread on a read-ahead thread) or uring (batched io_uring reads) (default: %default)")
+    ;
+    gOptions
+        .add_option("--hugePages")
+        .action("store")
+        .type("int")
+        .set_default(1)
+        .help("back hash tables and block pools with 2MB pages: hugetlb pages if the system has some set aside, else transparent huge pages. 0 to stick to regular pages (default: %default)")
+    ;
+    gOptions
+        .add_option("--memJSON")
+        .action("store")
+        .set_default("")
+        .help("also write the memory report printed at the end of the run, and on SIGUSR1, to <file> as JSON")
+    ;
+    gOptions
+        .add_option("--profile")
+        .action("store_true")
+        .set_default(false)
+        .help("time each phase of the run, hot parser operations and command hooks, and print them with their throughput at the end")
+    ;
+    gOptions
+        .add_option("--jsonProfile")
+        .action("store")
+        .set_default("")
+        .help("with --profile, also write the timings to <file> as JSON")
+    ;
+    gOptions
+        .add_option("--hookProfile")
+        .action("store_true")
+        .set_default(false)
+        .help("time every call the parser makes to the command's hooks, and print per hook call counts and latency histograms after wrapup")
+    ;
+    gOptions
+        .add_option("--from")
+        .action("store")
+        .type("int")
+        .set_default(0)
+        .help("only run the command on blocks at height <height> and up (default: from first block)")
+    ;
+    gOptions
+        .add_option("--to")
+        .action("store")
+        .type("int")
+        .set_default(-1)
+        .help("stop parsing after the block at height <height> (default: up to last block)")
+    ;
+    gOptions
+        .add_option("--since")
+        .action("store")
+        .type("int")
+        .set_default(0)
+        .help("only run the command from the first block stamped at or after unix time <time> (default: from first block)")
+    ;
+    gOptions
+        .add_option("--until")
+        .action("store")
+        .type("int")
+        .set_default(-1)
+        .help("stop parsing ahead of the first block stamped after unix time <time> (default: up to last block)")
+    ;
+
+    // Parser options come before the command name, leave "--help" to the help command
+    bool hasOptions = (
+        1<argc                      &&
+        '-'==argv[1][0]             &&
+        '-'==argv[1][1]             &&
+        0!=strcmp(argv[1], "--help")
+    );
+
+    optparse::Values &values = gOptions.parse_args(hasOptions ? argc : 1, argv);
+    gUseTXStore = values.get("txStore");
+    gUseUTXO = values.get("utxo");
+    gPacked = values.get("packed");
+    gFromHeight = values.get("from");
+    gToHeight = values.get("to");
+    gFromTime = values.get("since");
+    gToTime = values.get("until");
+    gSnapshotEvery = values.get("snapshotEvery");
+    int readAhead = values.get("readAhead");
+    gReadAhead = (readAhead<0) ? 0 : ((uint64_t)readAhead)<<20;
+    if(values.get("profile")) profileStart();
+    gProfileJSON = (const char*)values.get("jsonProfile");
+    gHookProfile = values.get("hookProfile");
+    int huge = values.get("hugePages");
+    setHugePages(0!=huge);
+    gMemJSON = (const char*)values.get("memJSON");
+    signal(SIGUSR1, requestMemStats);
+    gNbJobs = values.get("jobs");
+    if(gNbJobs<1) gNbJobs = boost::thread::hardware_concurrency();
+    int zstdWindow = values.get("zstdWindow");
+    uint64_t zstdWindowBytes = (zstdWindow<0) ? 0 : ((uint64_t)zstdWindow)<<20;
+    std::string sourceName = (const char*)values.get("source");
+    gSource = BlockSource::create(sourceName.c_str(), values.get("populate"), gNbJobs, zstdWindowBytes);
+    if(0==gSource) errFatal("unknown block source \"%s\", expected mmap, read or uring", sourceName.c_str());
+
+    if(hasOptions) {
+        int nbConsumed = (argc - 1) - gOptions.args().size();
+        for(int i=1; i+nbConsumed<=argc; ++i) argv[i] = argv[i + nbConsumed];
+        argc -= nbConsumed;
+    }
+}
+
+static void reportMemory()
+{
+    MemStats stats;
+    stats.owner = "parser";
+    stats.addTable("txMap", gTXMap);
+    stats.addTable("blockMap", gBlockMap);
+    stats.addTable("utxoMap", gUTXOMap);
+    stats.addTable("outputTables", gOutputTables);
+    stats.addVector("allBlocks", gAllBlocks);
+    stats.addVector("indexedBlocks", gIndexedBlocks);
+    stats.addVector("upTXs", gUpTXs);
+    stats.addVector("upHashes", gUpHashes);
+
+    // Prep tasks hash TXs ahead of the parse, and count what they allocate
+    uint64_t txHashBytes = __sync_fetch_and_add(&gTXHashBytes, 0);
+    uint64_t outputTableBytes = __sync_fetch_and_add(&gOutputTableBytes, 0);
+    uint64_t utxoBytes = __sync_fetch_and_add(&gUTXOBytes, 0);
+    stats.add("txHashes", txHashBytes, txHashBytes, txHashBytes/kSHA256ByteSize);
+    stats.add("outputTableBytes", outputTableBytes, outputTableBytes, gOutputTables.size());
+    stats.add("utxos", utxoBytes, utxoBytes, gUTXOMap.size());
+
+    stats.owner = "arena";
+    arenaStats(stats);
+
+    if(gCallback) {
+        stats.owner = gCallback->name();
+        gCallback->memStats(stats);
+    }
+
+    stats.print();
+    if(!gMemJSON.empty()) stats.writeJSON(gMemJSON.c_str());
+}
+
+// Reports get taken at points where nothing else changes what they measure:
+// between blocks on the thread that runs the first or second pass. Range
+// workers each run their own part and arena, so a request made while they
+// run waits until every range is parsed and merged
+void pollMemStats()
+{
+    if(gRangeWorker) return;
+    if(1==__sync_lock_test_and_set(&gMemStatsRequested, 0)) reportMemory();
+}
+
+const optparse::OptionParser &parserOptions()
+{
+    return gOptions;
+}
+
+const std::string &packDir()
+{
+    return gPackDir;
 }
 
 static void initCallback(
@@ -361,11 +1273,19 @@ static void initCallback(
 
     int ir = gCallback->init(argc, (const char **)argv);
     if(ir<0) errFatal("callback init failed");
-    gNeedTXHash = gCallback->needTXHash();
+
+    // Wrapped once initialized: init may look other commands up by name
+    if(gHookProfile) gCallback = profileHooks(gCallback);
+
+    // TX hashes only ever reach TX, output and edge hooks, and upstream TXs edge hooks
+    gEvents = kBlockEvents | gCallback->events();
+    gNeedTXHash = gCallback->needTXHash() && 0!=(gEvents & (kTXEvents | kOutputEvents | kEdgeEvents));
+    gNeedUpTX = gNeedTXHash && 0!=(gEvents & kEdgeEvents);
 }
 
 static void mapBlockChainFiles()
 {
+    ProfileTimer timer(kProfileMapFiles);
     std::string coinName( "/.SonicScrewdriver/");
 
     const char *home = getenv("HOME");
@@ -375,7 +1295,16 @@ static void mapBlockChainFiles()
     }
 
     std::string homeDir(home);
+    gPackDir = homeDir + coinName + std::string("packed/");
+
+    // A repacked chain keeps index, TX store and snapshots of its own:
+    // they hold file offsets
+    if(gPacked) coinName += std::string("packed/");
+
     std::string blockDir = homeDir + coinName + std::string("blocks");
+    gBlockIndexName = homeDir + coinName + std::string("blockparser.idx");
+    gTXStoreName = homeDir + coinName + std::string("blockparser");
+    gSnapshotName = homeDir + coinName + std::string("blockparser.utxo");
 
     struct stat statBuf;
     int r = stat(blockDir.c_str(), &statBuf);
@@ -383,6 +1312,10 @@ static void mapBlockChainFiles()
 
     int blkDatId = oldStyle ? 1 : 0;
     const char *fmt = oldStyle ? "blk%04d.dat" : "blocks/blk%05d.dat";
+    if(gPacked) {
+        blkDatId = 0;
+        fmt = "pack%05d.dat";
+    }
     while(1) {
 
         char buf[64];
@@ -394,7 +1327,14 @@ static void mapBlockChainFiles()
             std::string(buf)
         ;
 
-        int blockMapFD = open(blockMapFileName.c_str(), O_DIRECT | O_RDONLY);
+        // Cold copies of the chain may be kept as zstd archives
+        int blockMapFD = open(blockMapFileName.c_str(), O_RDONLY);
+        if(blockMapFD<0) {
+            std::string archiveName = blockMapFileName + ".zst";
+            blockMapFD = open(archiveName.c_str(), O_RDONLY);
+            if(0<=blockMapFD) blockMapFileName = archiveName;
+        }
+
         if(blockMapFD<0) {
             if(1<blkDatId) break;
             sysErrFatal(
@@ -407,37 +1347,33 @@ static void mapBlockChainFiles()
         int r = fstat(blockMapFD, &statBuf);
         if(r<0) sysErrFatal( "failed to fstat block chain file %s", blockMapFileName.c_str());
 
-        size_t mapSize = statBuf.st_size;
-        void *pMap = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, blockMapFD, 0);
-        if(((void*)-1)==pMap) {
-            sysErrFatal(
-                "failed to mmap block chain file %s",
-                blockMapFileName.c_str()
-            );
-        }
-
-        Map map;
-        map.size = mapSize;
+        BlockFile map;
+        map.size = statBuf.st_size;
+        map.mtime = statBuf.st_mtim.tv_sec*1000000000LL + statBuf.st_mtim.tv_nsec;
         map.fd = blockMapFD;
         map.name = blockMapFileName;
-        map.p = (const uint8_t*)pMap;
+        gSource->open(map);
         mapVec.push_back(map);
+        profileCount(kProfileMapFiles, map.size, 0, 0, 0);
     }
 }
 
 static void initHashtables()
 {
-    gTXMap.setEmptyKey(empty);
-    gBlockMap.setEmptyKey(empty);
+    if(!gNeedUpTX) gUseUTXO = false;
+
+    // Edges point into UTXOs that get freed as soon as the edge hook returns
+    if(gUseUTXO && gCallback->asyncEvents()) {
+        warning("--utxo ignored: command \"%s\" handles events asynchronously", gCallback->name());
+        gUseUTXO = false;
+    }
 
     auto e = mapVec.end();
     uint64_t totalSize = 0;
     auto i = mapVec.begin();
     while(i!=e) totalSize += (i++)->size;
 
-    double txPerBytes = (3976774.0 / 1713189944.0);
-    size_t nbTxEstimate = (1.5 * txPerBytes * totalSize);
-    gTXMap.resize(nbTxEstimate);
+    gNbTXEstimate = (1.5 * kTXPerByte * totalSize);
 
     double blocksPerBytes = (184284.0 / 1713189944.0);
     size_t nbBlockEstimate = (1.5 * blocksPerBytes * totalSize);
@@ -493,6 +1429,9 @@ static void linkBlock(
 
 static void linkAllBlocks()
 {
+    ProfileTimer timer(kProfileLinkBlocks);
+    profileCount(kProfileLinkBlocks, 0, gBlockMap.size(), 0, 0);
+
     auto e = gBlockMap.end();
     auto i = gBlockMap.begin();
     while(i!=e) {
@@ -502,66 +1441,396 @@ static void linkAllBlocks()
     }
 }
 
-static bool buildBlock(
+static bool scanBlock(
     const uint8_t *&p,
-    const uint8_t *e
+    const uint8_t *e,
+    MapScan       &scan
 )
 {
     static const uint32_t expected = 0x05223570;
 
 
     if(unlikely(e<=(8+p))) {
-        printf("end of map, reason : pointer past EOF\n");
+        snprintf(scan.reason, sizeof(scan.reason), "pointer past EOF");
         return true;
     }
 
-    LOAD(uint32_t, magic, p);
+    // Only move p past complete blocks: where it stops is where a later
+    // run resumes scanning once the file has grown
+    const uint8_t *q = p;
+
+    LOAD(uint32_t, magic, q);
     if(unlikely(expected!=magic)) {
-        printf("end of map, reason : magic is fucked %d away from EOF got %#010x\n", (int)(e-p), magic);
+        snprintf(scan.reason, sizeof(scan.reason), "magic is fucked %d away from EOF got %#010x", (int)(e-q), magic);
         return true;
     }
 
-    LOAD(uint32_t, size, p);
-    if(unlikely(e<(p+size))) {
-        printf("end of map, reason : end of block past EOF, %d past EOF\n", (int)((p+size)-e));
+    LOAD(uint32_t, size, q);
+    if(unlikely(e<(q+size))) {
+        snprintf(scan.reason, sizeof(scan.reason), "end of block past EOF, %d past EOF", (int)((q+size)-e));
         return true;
     }
 
+    ScannedBlock block;
+    block.data = q;
+    scan.blocks.push_back(block);
+    p = q + size;
+    return false;
+}
+
+// Keep --readAhead bytes past p coming in while a scan goes through a blk
+// file, and retire what it is past. Returns where to come back
+static const uint8_t *scanAhead(
+    const BlockFile &map,
+    const uint8_t   *p,
+    uint64_t        start
+)
+{
+    uint64_t offset = p - map.p;
+    uint64_t half = gReadAhead/2;
+    gSource->retire(map, start, offset);
+    gSource->willNeed(map, offset, offset + gReadAhead);
+    gSource->wait(map, offset + half + 8);
+    return (offset + half) + map.p;
+}
+
+static void scanMap(
+    const BlockFile *map,
+    MapScan         &scan
+)
+{
+    const uint8_t *end = map->size + map->p;
+    const uint8_t *p = scan.start + map->p;
+    const uint8_t *ahead = (0<gReadAhead) ? p : end;
+
+    scan.reason[0] = 0;
+    scan.blocks.reserve(map->size/256);
+
+    gSource->access(*map, scan.start, map->size, BlockSource::kSequential);
+    if(end==ahead) gSource->wait(*map, map->size);
+
+        while(1) {
+            if(unlikely(end<=p)) break;
+            if(unlikely(ahead<=p)) ahead = scanAhead(*map, p, scan.start);
+            bool done = scanBlock(p, end, scan);
+            if(done) break;
+        }
+
+    scan.end = p;
+    gSource->wait(*map, scan.end - map->p);
+
+    // Hash all headers of the file in one batch, while their pages are still in
+    size_t nbBlocks = scan.blocks.size();
+    std::vector<uint8_t*> hashes(nbBlocks);
+    std::vector<const uint8_t*> headers(nbBlocks);
+    std::vector<size_t> sizes(nbBlocks, 80);
+    for(size_t i=0; i<nbBlocks; ++i) {
+        hashes[i] = scan.blocks[i].hash.v;
+        headers[i] = scan.blocks[i].data;
+    }
+    sha256dBatch(hashes.data(), headers.data(), sizes.data(), nbBlocks);
+
+    // The second pass comes back for these pages much later, and in its own
+    // order: unmap them for now, they stay in the page cache if memory allows
+    gSource->release(*map, scan.start, map->size);
+    gSource->access(*map, scan.start, map->size, BlockSource::kNormal);
+}
+
+static boost::mutex gScanMutex;
+static boost::condition_variable gScanCond;
+
+static void scanWorker(
+    std::vector<MapScan> *scans,
+    size_t               *nextMap
+)
+{
+    while(1) {
+
+        size_t i = __sync_fetch_and_add(nextMap, 1);
+        if(unlikely(mapVec.size()<=i)) break;
+
+        MapScan &scan = (*scans)[i];
+        if(scan.done) continue;
+        scanMap(&mapVec[i], scan);
+
+        boost::lock_guard<boost::mutex> lock(gScanMutex);
+        scan.done = true;
+        gScanCond.notify_all();
+    }
+}
+
+static bool lastBlockMatches(
+    const BlockFile       &map,
+    const BlockIndexEntry *indexed,
+    uint64_t              nbIndexed
+)
+{
+    if(0==nbIndexed) return true;
+
+    const BlockIndexEntry &last = indexed[nbIndexed-1];
+    if(map.size<(last.offset + last.size)) return false;
+    gSource->wait(map, last.offset + 80);
+
+    uint256_t hash;
+    sha256Twice(hash.v, last.offset + map.p, 80);
+    return 0==memcmp(hash.v, last.hash.v, kSHA256ByteSize);
+}
+
+// Decide, for each blk file, how much of it the block index already
+// covers. Unchanged files need no scanning at all, files that were
+// appended to are only scanned past the point where the index stops
+static void planScans(
+    std::vector<MapScan> &scans
+)
+{
+    gRelinkAll = true;
+    gIndexDirty = true;
+    bool loaded = gBlockIndex.load(gBlockIndexName);
+    if(!loaded) return;
+
+    gRelinkAll = false;
+    gIndexDirty = (gBlockIndex.nbFiles()!=mapVec.size());
+    gIndexedBlocks.resize(gBlockIndex.nbBlocks(), 0);
+
+    uint64_t firstIndexed = 0;
+    const BlockIndexFile *files = gBlockIndex.files();
+    const BlockIndexEntry *entries = gBlockIndex.entries();
+    for(uint64_t i=0; i<gBlockIndex.nbFiles(); ++i) {
+
+        const BlockIndexFile &file = files[i];
+        const BlockIndexEntry *indexed = firstIndexed + entries;
+        uint64_t nbIndexed = file.nbBlocks;
+        firstIndexed += nbIndexed;
+
+        if(mapVec.size()<=i) {
+            gRelinkAll = true;
+            continue;
+        }
+
+        const BlockFile &map = mapVec[i];
+        bool unchanged = (map.size==file.size && map.mtime==file.mtime);
+        bool appended = (
+            !unchanged                                  &&
+            file.scanEnd<=map.size                      &&
+            lastBlockMatches(map, indexed, nbIndexed)
+        );
+        if(!unchanged && !appended) {
+            gRelinkAll = true;
+            gIndexDirty = true;
+            continue;
+        }
+
+        MapScan &scan = scans[i];
+        scan.indexed = indexed;
+        scan.nbIndexed = nbIndexed;
+        scan.start = file.scanEnd;
+        scan.firstIndexed = firstIndexed - nbIndexed;
+
+        if(unchanged) {
+            scan.done = true;
+            scan.end = file.scanEnd + map.p;
+            memcpy(scan.reason, file.reason, sizeof(scan.reason));
+            scan.reason[sizeof(scan.reason)-1] = 0;
+        } else {
+            gIndexDirty = true;
+        }
+    }
+}
+
+static void addBlock(
+    const uint8_t *data,
+    const uint8_t *hash,
+    uint32_t      fileId
+)
+{
     Block *block = allocBlock();
     block->height = -1;
-    block->data = p;
+    block->data = data;
     block->prev = 0;
     block->next = 0;
-
-    uint8_t *hash = allocHash256();
-    sha256Twice(hash, p, 80);
     gBlockMap[hash] = block;
-    p += size;
-    return false;
+
+    FoundBlock found;
+    found.block = block;
+    found.hash = hash;
+    found.fileId = fileId;
+    gAllBlocks.push_back(found);
 }
 
+// Worker threads scan the maps and hash block headers, while the main
+// thread merges finished maps into gBlockMap in file order, so that the
+// resulting map (and the callbacks) are exactly what a serial scan yields
 static void buildAllBlocks()
 {
-    auto e = mapVec.end();
-    auto i = mapVec.begin();
-    while(i!=e) {
+    ProfileTimer timer(kProfileScanBlocks);
+    size_t nbMaps = mapVec.size();
+    std::vector<MapScan> scans(nbMaps);
+    for(size_t i=0; i<nbMaps; ++i) {
+        MapScan &scan = scans[i];
+        scan.done = false;
+        scan.start = 0;
+        scan.reason[0] = 0;
+        scan.indexed = 0;
+        scan.nbIndexed = 0;
+        scan.firstIndexed = 0;
+    }
+    planScans(scans);
+
+    size_t nbToScan = 0;
+    for(size_t i=0; i<nbMaps; ++i) {
+        if(!scans[i].done) ++nbToScan;
+    }
 
-        const Map *map = gCurMap = &(*(i++));
-        const uint8_t *end = map->size + map->p;
-        const uint8_t *p = map->p;
+    size_t nbThreads = boost::thread::hardware_concurrency();
+    if(nbThreads<1) nbThreads = 1;
+    if(nbToScan<nbThreads) nbThreads = nbToScan;
 
-        startMap(p);
+    size_t nextMap = 0;
+    boost::thread_group workers;
+    for(size_t t=0; t<nbThreads; ++t)
+        workers.add_thread(new boost::thread(scanWorker, &scans, &nextMap));
+
+    uint64_t nbRestored = 0;
+    uint64_t nbScanned = 0;
+    for(size_t i=0; i<nbMaps; ++i) {
+
+        MapScan &scan = scans[i];
+        if(unlikely(gMemStatsRequested)) pollMemStats();
+        {
+            boost::unique_lock<boost::mutex> lock(gScanMutex);
+            while(!scan.done) gScanCond.wait(lock);
+        }
 
-            while(1) {
-                if(unlikely(end<=p)) break;
-                bool done = buildBlock(p, end);
-                if(done) break;
+        // Files the index covers in full were never scanned: from here on,
+        // all of every file is read without waiting
+        const BlockFile *map = gCurMap = &mapVec[i];
+        gSource->wait(*map, map->size);
+        startMap(map->p);
+
+            for(uint64_t j=0; j<scan.nbIndexed; ++j) {
+                const BlockIndexEntry &entry = scan.indexed[j];
+                addBlock(entry.offset + map->p, entry.hash.v, i);
+                gIndexedBlocks[scan.firstIndexed + j] = gAllBlocks.back().block;
+            }
+
+            auto e = scan.blocks.end();
+            auto j = scan.blocks.begin();
+            while(j!=e) {
+
+                const ScannedBlock &scanned = *(j++);
+
+                uint8_t *hash = allocHash256();
+                memcpy(hash, scanned.hash.v, kSHA256ByteSize);
+                addBlock(scanned.data, hash, i);
             }
 
-        endMap(p);
+            if(scan.reason[0]) printf("end of map, reason : %s\n", scan.reason);
+
+        endMap(scan.end);
+
+        BlockIndexFile file;
+        memset(&file, 0, sizeof(file));
+        file.size = map->size;
+        file.mtime = map->mtime;
+        file.scanEnd = scan.end - map->p;
+        file.nbBlocks = scan.nbIndexed + scan.blocks.size();
+        memcpy(file.reason, scan.reason, sizeof(file.reason));
+        gIndexFiles.push_back(file);
+
+        nbRestored += scan.nbIndexed;
+        nbScanned += scan.blocks.size();
+        profileCount(kProfileScanBlocks, map->size, scan.nbIndexed + scan.blocks.size(), 0, 0);
+        std::vector<ScannedBlock>().swap(scan.blocks);
+    }
+
+    workers.join_all();
+
+    if(0<nbRestored) {
+        info(
+            "block index: %" PRIu64 " blocks restored, %" PRIu64 " blocks scanned",
+            nbRestored,
+            nbScanned
+        );
     }
 }
 
+static Block *indexedBlock(
+    int64_t ref
+)
+{
+    if(BlockIndex::kNullBlockRef==ref) return gNullBlock;
+    if(BlockIndex::kNoBlockRef==ref) return 0;
+    return gIndexedBlocks[ref];
+}
+
+// Re-establish the heights and links recorded in the block index. Returns
+// true if that alone yields the final chain, i.e. nothing new was scanned
+static bool restoreLinks()
+{
+    if(gRelinkAll) return false;
+
+    const BlockIndexEntry *entries = gBlockIndex.entries();
+    for(uint64_t i=0; i<gBlockIndex.nbBlocks(); ++i) {
+        const BlockIndexEntry &entry = entries[i];
+        Block *block = gIndexedBlocks[i];
+        block->height = entry.height;
+        block->prev = indexedBlock(entry.prev);
+        block->next = indexedBlock(entry.next);
+    }
+
+    gNullBlock->height = 0;
+    gNullBlock->prev = 0;
+    gNullBlock->next = 0;
+
+    gMaxBlock = indexedBlock(gBlockIndex.maxBlock());
+    gMaxHeight = gMaxBlock ? gMaxBlock->height : 0;
+    return !gIndexDirty;
+}
+
+static int64_t blockRef(
+    const std::unordered_map<const Block*, int64_t> &ids,
+    const Block                                     *block
+)
+{
+    if(0==block) return BlockIndex::kNoBlockRef;
+    if(gNullBlock==block) return BlockIndex::kNullBlockRef;
+    return ids.find(block)->second;
+}
+
+static void saveBlockIndex()
+{
+    if(!gIndexDirty) return;
+
+    std::unordered_map<const Block*, int64_t> ids;
+    ids.reserve(gAllBlocks.size());
+    for(size_t i=0; i<gAllBlocks.size(); ++i) ids[gAllBlocks[i].block] = i;
+
+    std::vector<BlockIndexEntry> entries(gAllBlocks.size());
+    for(size_t i=0; i<gAllBlocks.size(); ++i) {
+
+        const FoundBlock &found = gAllBlocks[i];
+        const Block *block = found.block;
+        const uint8_t *p = -4 + block->data;
+        LOAD(uint32_t, size, p);
+
+        BlockIndexEntry &entry = entries[i];
+        memcpy(entry.hash.v, found.hash, kSHA256ByteSize);
+        entry.fileId = found.fileId;
+        entry.size = size;
+        entry.offset = block->data - mapVec[found.fileId].p;
+        entry.height = block->height;
+        entry.prev = blockRef(ids, block->prev);
+        entry.next = blockRef(ids, block->next);
+    }
+
+    BlockIndex::save(
+        gBlockIndexName,
+        gIndexFiles,
+        entries,
+        blockRef(ids, gMaxBlock)
+    );
+}
+
 static void buildNullBlock()
 {
     gBlockMap[gNullHash.v] = gNullBlock = allocBlock();
@@ -572,14 +1841,26 @@ static void firstPass()
 {
     buildNullBlock();
     buildAllBlocks();
-    linkAllBlocks();
+
+    bool linked = restoreLinks();
+    if(!linked) linkAllBlocks();
 }
 
 static void secondPass()
 {
     findLongestChain();
+    findRange();
+    saveBlockIndex();
+    openTXStore();
+    restoreSnapshot();
+    planReleases();
     parseLongestChain();
-    gCallback->wrapup();
+    gTXStore.flush();
+    {
+        ProfileTimer timer(kProfileWrapup);
+        gCallback->wrapup();
+    }
+    reportMemory();
 }
 
 static void cleanMaps()
@@ -588,15 +1869,17 @@ static void cleanMaps()
     auto i = mapVec.begin();
     while(i!=e) {
 
-        const Map &map = *(i++);
+        const BlockFile &map = *(i++);
 
-        int r = munmap((void*)map.p, map.size);
-        if(r<0) sysErr("failed to unmap block chain file %s", map.name.c_str());
+        gSource->close(map);
 
-        r = close(map.fd);
+        int r = close(map.fd);
         if(r<0) sysErr("failed to unmap block chain file %s", map.name.c_str());
 
     }
+
+    delete gSource;
+    gSource = 0;
 }
 
 int main(
@@ -606,12 +1889,16 @@ int main(
 {
     double start = usecs();
 
+        initOptions(argc, argv);
         initCallback(argc, argv);
         mapBlockChainFiles();
         initHashtables();
         firstPass();
         secondPass();
+        gTXStore.close();
         cleanMaps();
+        hugePagesReport();
+        profileReport(gProfileJSON.empty() ? 0 : gProfileJSON.c_str());
 
     double elapsed = (usecs()-start)*1e-6;
     info("all done in %.3f seconds\n", elapsed);
@@ -0,0 +1,14 @@
+#ifndef __PARSER_H__
+    #define __PARSER_H__
+
+    #include <string>
+    #include <option.h>
+
+    // Options that apply to the parser itself, given before the command name
+    const optparse::OptionParser &parserOptions();
+
+    // Where the repack command writes the chain, and "--packed" reads it from
+    const std::string &packDir();
+
+#endif // __PARSER_H__
+
@@ -0,0 +1,226 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <profile.h>
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <boost/thread.hpp>
+
+bool gProfile;
+
+static double gStartUsecs;
+static uint64_t gStartClock;
+static boost::mutex gThreadsMutex;
+static std::vector<ProfileCounters*> gThreads;
+static __thread ProfileCounters *gCounters;
+
+static const char *const kPhaseNames[kNbProfilePhases] = {
+    "mapFiles",
+    "scanBlocks",
+    "linkBlocks",
+    "longestChain",
+    "secondPass",
+    "wrapup",
+    "hashTX",
+    "txInsert",
+    "txLookup",
+    "solveScript",
+    "hook start",
+    "hook startBlock",
+    "hook endBlock",
+    "hook startTX",
+    "hook endTX",
+    "hook startInputs",
+    "hook endInputs",
+    "hook startInput",
+    "hook endInput",
+    "hook startOutputs",
+    "hook endOutputs",
+    "hook startOutput",
+    "hook endOutput",
+    "hook edge"
+};
+
+// Counters of threads that are gone still count
+ProfileCounters *profileCounters()
+{
+    if(unlikely(0==gCounters)) {
+        ProfileCounters *counters = new ProfileCounters[kNbProfilePhases];
+        memset(counters, 0, kNbProfilePhases*sizeof(ProfileCounters));
+
+        boost::lock_guard<boost::mutex> lock(gThreadsMutex);
+        gThreads.push_back(counters);
+        gCounters = counters;
+    }
+    return gCounters;
+}
+
+void profileStart()
+{
+    gStartUsecs = usecs();
+    gStartClock = profileClock();
+    gProfile = true;
+}
+
+struct PhaseTotals
+{
+    ProfileCounters c;
+    double          seconds;
+};
+
+static void perSecond(
+    char     *buf,
+    size_t   size,
+    uint64_t n,
+    double   seconds,
+    double   scale
+)
+{
+    if(0==n || seconds<=0.0) snprintf(buf, size, "-");
+    else                     snprintf(buf, size, "%.1f", scale*n/seconds);
+}
+
+// Rates of a phase that took no measurable time have no value
+static void jsonRate(
+    char     *buf,
+    size_t   size,
+    uint64_t n,
+    double   seconds,
+    double   scale
+)
+{
+    if(seconds<=0.0) snprintf(buf, size, "null");
+    else             snprintf(buf, size, "%.3f", scale*n/seconds);
+}
+
+void profileReport(
+    const char *jsonPath
+)
+{
+    if(!gProfile) return;
+
+    double elapsed = (usecs() - gStartUsecs)*1e-6;
+    uint64_t clocks = profileClock() - gStartClock;
+    double secondsPerClock = (0<clocks) ? elapsed/clocks : 0.0;
+
+    std::vector<PhaseTotals> totals(kNbProfilePhases);
+    memset(&totals[0], 0, kNbProfilePhases*sizeof(PhaseTotals));
+    {
+        boost::lock_guard<boost::mutex> lock(gThreadsMutex);
+        for(size_t t=0; t<gThreads.size(); ++t) {
+            for(int i=0; i<kNbProfilePhases; ++i) {
+                const ProfileCounters &from = gThreads[t][i];
+                ProfileCounters &to = totals[i].c;
+                to.cycles += from.cycles;
+                to.calls += from.calls;
+                to.bytes += from.bytes;
+                to.blocks += from.blocks;
+                to.txs += from.txs;
+                to.inputs += from.inputs;
+            }
+        }
+    }
+    for(int i=0; i<kNbProfilePhases; ++i) totals[i].seconds = totals[i].c.cycles*secondsPerClock;
+
+    // Phases overlap: the second pass includes the operations and hooks
+    // that run inside it, and work done on other threads adds up past
+    // wall time
+    info("profile: %.3f seconds in total", elapsed);
+    fprintf(
+        stderr,
+        "    %-18s %9s %7s %12s %9s %10s %10s %10s %10s\n",
+        "phase",
+        "seconds",
+        "share",
+        "calls",
+        "ns/call",
+        "MB/s",
+        "blocks/s",
+        "TX/s",
+        "inputs/s"
+    );
+
+    for(int i=0; i<kNbProfilePhases; ++i) {
+
+        const PhaseTotals &phase = totals[i];
+        if(0==phase.c.calls) continue;
+
+        char mbs[32], blocks[32], txs[32], inputs[32];
+        perSecond(mbs, sizeof(mbs), phase.c.bytes, phase.seconds, 1e-6);
+        perSecond(blocks, sizeof(blocks), phase.c.blocks, phase.seconds, 1.0);
+        perSecond(txs, sizeof(txs), phase.c.txs, phase.seconds, 1.0);
+        perSecond(inputs, sizeof(inputs), phase.c.inputs, phase.seconds, 1.0);
+
+        fprintf(
+            stderr,
+            "    %-18s %9.3f %6.1f%% %12" PRIu64 " %9.1f %10s %10s %10s %10s\n",
+            kPhaseNames[i],
+            phase.seconds,
+            (0.0<elapsed) ? 100.0*phase.seconds/elapsed : 0.0,
+            phase.c.calls,
+            1e9*phase.seconds/phase.c.calls,
+            mbs,
+            blocks,
+            txs,
+            inputs
+        );
+    }
+    fflush(stderr);
+
+    if(0==jsonPath) return;
+
+    std::string tmpName = std::string(jsonPath) + ".tmp";
+    FILE *f = fopen(tmpName.c_str(), "w");
+    if(0==f) {
+        sysErr("failed to create %s", tmpName.c_str());
+        return;
+    }
+
+    fprintf(f, "{\n    \"seconds\": %.6f,\n    \"phases\": [\n", elapsed);
+    bool first = true;
+    for(int i=0; i<kNbProfilePhases; ++i) {
+
+        const PhaseTotals &phase = totals[i];
+        if(0==phase.c.calls) continue;
+
+        char mbs[32], blocks[32], txs[32], inputs[32];
+        jsonRate(mbs, sizeof(mbs), phase.c.bytes, phase.seconds, 1e-6);
+        jsonRate(blocks, sizeof(blocks), phase.c.blocks, phase.seconds, 1.0);
+        jsonRate(txs, sizeof(txs), phase.c.txs, phase.seconds, 1.0);
+        jsonRate(inputs, sizeof(inputs), phase.c.inputs, phase.seconds, 1.0);
+
+        fprintf(
+            f,
+            "%s        {\"name\": \"%s\", \"seconds\": %.6f, \"calls\": %" PRIu64 ", \"nsPerCall\": %.1f, \"bytes\": %" PRIu64
+            ", \"blocks\": %" PRIu64 ", \"txs\": %" PRIu64 ", \"inputs\": %" PRIu64
+            ", \"mbPerSecond\": %s, \"blocksPerSecond\": %s, \"txPerSecond\": %s, \"inputsPerSecond\": %s}",
+            first ? "" : ",\n",
+            kPhaseNames[i],
+            phase.seconds,
+            phase.c.calls,
+            1e9*phase.seconds/phase.c.calls,
+            phase.c.bytes,
+            phase.c.blocks,
+            phase.c.txs,
+            phase.c.inputs,
+            mbs,
+            blocks,
+            txs,
+            inputs
+        );
+        first = false;
+    }
+    fprintf(f, "\n    ]\n}\n");
+
+    bool ok = (0==fclose(f));
+    if(ok) ok = (0==rename(tmpName.c_str(), jsonPath));
+    if(!ok) {
+        sysErr("failed to write %s", jsonPath);
+        unlink(tmpName.c_str());
+    }
+}
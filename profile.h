@@ -0,0 +1,123 @@
+#ifndef __PROFILE_H__
+    #define __PROFILE_H__
+
+    #include <time.h>
+    #include <common.h>
+
+    #if defined(__x86_64__) || defined(__i386__)
+        #include <x86intrin.h>
+    #endif
+
+    // What "parser --profile" times. Phases of the run come first, then the
+    // hot operations inside them, then the command's hooks
+    enum ProfilePhase
+    {
+        kProfileMapFiles,
+        kProfileScanBlocks,
+        kProfileLinkBlocks,
+        kProfileLongestChain,
+        kProfileSecondPass,
+        kProfileWrapup,
+        kProfileHashTX,
+        kProfileTXInsert,
+        kProfileTXLookup,
+        kProfileSolveScript,
+        kProfileStart,
+        kProfileStartBlock,
+        kProfileEndBlock,
+        kProfileStartTX,
+        kProfileEndTX,
+        kProfileStartInputs,
+        kProfileEndInputs,
+        kProfileStartInput,
+        kProfileEndInput,
+        kProfileStartOutputs,
+        kProfileEndOutputs,
+        kProfileStartOutput,
+        kProfileEndOutput,
+        kProfileEdge,
+        kNbProfilePhases
+    };
+
+    // Time spent in a phase, how often it ran, and how much it got through
+    struct ProfileCounters
+    {
+        uint64_t cycles;
+        uint64_t calls;
+        uint64_t bytes;
+        uint64_t blocks;
+        uint64_t txs;
+        uint64_t inputs;
+    };
+
+    // Everything below costs a test of this flag when profiling is off
+    extern bool gProfile;
+
+    // This thread's counters, one per phase
+    ProfileCounters *profileCounters();
+
+    static inline uint64_t profileClock()
+    {
+        #if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+        #else
+            struct timespec t;
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            return t.tv_nsec + 1000000000ULL*t.tv_sec;
+        #endif
+    }
+
+    static inline void profileAdd(
+        ProfilePhase phase,
+        uint64_t     cycles
+    )
+    {
+        ProfileCounters &c = profileCounters()[phase];
+        c.cycles += cycles;
+        ++c.calls;
+    }
+
+    static inline void profileCount(
+        ProfilePhase phase,
+        uint64_t     bytes,
+        uint64_t     blocks,
+        uint64_t     txs,
+        uint64_t     inputs
+    )
+    {
+        if(likely(!gProfile)) return;
+        ProfileCounters &c = profileCounters()[phase];
+        c.bytes += bytes;
+        c.blocks += blocks;
+        c.txs += txs;
+        c.inputs += inputs;
+    }
+
+    // Times its own scope
+    struct ProfileTimer
+    {
+        ProfilePhase phase;
+        uint64_t     start;
+
+        ProfileTimer(
+            ProfilePhase p
+        )
+        {
+            phase = p;
+            start = unlikely(gProfile) ? profileClock() : 0;
+        }
+
+        ~ProfileTimer()
+        {
+            if(unlikely(gProfile)) profileAdd(phase, profileClock() - start);
+        }
+    };
+
+    // Turn profiling on, with the clock calibrated from here on
+    void profileStart();
+
+    // Print the phases that ran, and save them to jsonPath as JSON unless 0
+    void profileReport(const char *jsonPath);
+
+#endif // __PROFILE_H__
+
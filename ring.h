@@ -0,0 +1,135 @@
+#ifndef __RING_H__
+    #define __RING_H__
+
+    #include <stdlib.h>
+    #include <common.h>
+    #include <errlog.h>
+    #include <boost/thread.hpp>
+
+    // Bounded queue between exactly one producer thread and one consumer
+    // thread. Each side owns its index and only publishes it to the other
+    // every kBatch items, when it has to wait, or on flush, so that the two
+    // threads don't bounce a cache line back and forth on every item.
+    //
+    // kSize and kBatch must be powers of two.
+    template<
+        typename T,
+        size_t   kSize,
+        size_t   kBatch = 64
+    >
+    struct SPSCRing
+    {
+        SPSCRing()
+        {
+            void *p = 0;
+            int r = posix_memalign(&p, 64, kSize*sizeof(T));
+            if(0!=r) errFatal("failed to allocate ring buffer");
+            items = (T*)p;
+
+            head = 0;
+            tail = 0;
+            produced = 0;
+            tailSeen = 0;
+            consumed = 0;
+            headSeen = 0;
+        }
+
+        ~SPSCRing()
+        {
+            free(items);
+        }
+
+        // Producer: slot to fill next, waits for the consumer while the ring is full
+        T *claim()
+        {
+            int nbWaits = 0;
+            while(unlikely(kSize<=(produced - tailSeen))) {
+                tailSeen = tail;
+                __sync_synchronize();
+                if(kSize<=(produced - tailSeen)) {
+                    flush();
+                    wait(nbWaits);
+                }
+            }
+            return items + (produced & (kSize - 1));
+        }
+
+        // Producer: hand the slot last claimed over to the consumer
+        void commit()
+        {
+            ++produced;
+            if(unlikely(0==(produced & (kBatch - 1)))) flush();
+        }
+
+        void flush()
+        {
+            __sync_synchronize();
+            head = produced;
+        }
+
+        // Producer: wait until the consumer is done with every item committed.
+        // It publishes its index before waiting on an empty ring, so this
+        // returns once it sits idle in next()
+        void drain()
+        {
+            flush();
+            int nbWaits = 0;
+            while(tail!=produced) wait(nbWaits);
+            __sync_synchronize();
+        }
+
+        // Consumer: next item, waits for the producer while the ring is empty
+        const T *next()
+        {
+            int nbWaits = 0;
+            while(unlikely(consumed==headSeen)) {
+                headSeen = head;
+                __sync_synchronize();
+                if(consumed==headSeen) {
+                    release();
+                    wait(nbWaits);
+                }
+            }
+            return items + (consumed & (kSize - 1));
+        }
+
+        // Consumer: done with the item last returned by next
+        void pop()
+        {
+            ++consumed;
+            if(unlikely(0==(consumed & (kBatch - 1)))) release();
+        }
+
+    private:
+        SPSCRing(const SPSCRing &);
+        SPSCRing &operator=(const SPSCRing &);
+
+        void release()
+        {
+            __sync_synchronize();
+            tail = consumed;
+        }
+
+        static void wait(
+            int &nbWaits
+        )
+        {
+            if(++nbWaits<64) __builtin_ia32_pause();
+            else             boost::this_thread::yield();
+        }
+
+        T *items;
+
+        volatile uint64_t head;                 // Published by producer
+        uint8_t pad0[64 - sizeof(uint64_t)];
+        volatile uint64_t tail;                 // Published by consumer
+        uint8_t pad1[64 - sizeof(uint64_t)];
+        uint64_t produced;                      // Producer's own
+        uint64_t tailSeen;
+        uint8_t pad2[64 - 2*sizeof(uint64_t)];
+        uint64_t consumed;                      // Consumer's own
+        uint64_t headSeen;
+    };
+
+#endif // __RING_H__
+
@@ -1,6 +1,348 @@
 
 #include <sha256.h>
-#include "openssl/sha.h"
+
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+    #include <immintrin.h>
+    #define SHA256_X86
+#endif
+
+static const uint32_t kInit[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t kRound[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t loadBE(
+    const uint8_t *p
+)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap32(v);
+}
+
+static inline void storeBE(
+    uint8_t  *p,
+    uint32_t v
+)
+{
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// Rounds of the compression function on any type that has uint32_t
+// arithmetic: a plain uint32_t for one message, or a GCC vector of N
+// uint32_t to run N independent messages in N SIMD lanes
+#define ROR(x, n) (((x)>>(n)) | ((x)<<(32 - (n))))
+
+template<
+    typename V
+>
+static inline __attribute__((always_inline)) void compress(
+    V *s,
+    V *w
+)
+{
+    V a = s[0], b = s[1], c = s[2], d = s[3];
+    V e = s[4], f = s[5], g = s[6], h = s[7];
+    for(int i=0; i<64; ++i) {
+
+        if(16<=i) {
+            V w2 = w[(i-2) & 15];
+            V w15 = w[(i-15) & 15];
+            V s0 = ROR(w15, 7) ^ ROR(w15, 18) ^ (w15>>3);
+            V s1 = ROR(w2, 17) ^ ROR(w2, 19) ^ (w2>>10);
+            w[i & 15] += s1 + w[(i-7) & 15] + s0;
+        }
+
+        V t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + (g ^ (e & (f ^ g))) + kRound[i] + w[i & 15];
+        V t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+static void transformScalar(
+    uint32_t      *s,
+    const uint8_t *blocks,
+    size_t        nbBlocks
+)
+{
+    while(nbBlocks--) {
+        uint32_t w[16];
+        for(int i=0; i<16; ++i) w[i] = loadBE(4*i + blocks);
+        compress(s, w);
+        blocks += 64;
+    }
+}
+
+// Multi-buffer compression of one block per lane. s holds the 8 state
+// words of every lane, word major: s[8*N]
+template<
+    typename V,
+    int      N
+>
+static inline __attribute__((always_inline)) void transformLanes(
+    uint32_t            *s,
+    const uint8_t *const *blocks
+)
+{
+    V state[8];
+    V w[16];
+    for(int i=0; i<16; ++i) {
+        for(int lane=0; lane<N; ++lane) {
+            w[i][lane] = loadBE(4*i + blocks[lane]);
+        }
+    }
+    memcpy(state, s, sizeof(state));
+    compress(state, w);
+    memcpy(s, state, sizeof(state));
+}
+
+#if defined(SHA256_X86)
+
+    typedef uint32_t v4u __attribute__((vector_size(16)));
+    typedef uint32_t v8u __attribute__((vector_size(32)));
+
+    __attribute__((target("sse4.1")))
+    static void transform4(
+        uint32_t            *s,
+        const uint8_t *const *blocks
+    )
+    {
+        transformLanes<v4u, 4>(s, blocks);
+    }
+
+    __attribute__((target("avx2")))
+    static void transform8(
+        uint32_t            *s,
+        const uint8_t *const *blocks
+    )
+    {
+        transformLanes<v8u, 8>(s, blocks);
+    }
+
+    #define SHANI __attribute__((target("sha,sse4.1,ssse3")))
+
+    SHANI static inline void quadRound(
+        __m128i &s0,
+        __m128i &s1,
+        __m128i m,
+        int     i
+    )
+    {
+        __m128i msg = _mm_add_epi32(m, _mm_load_si128((const __m128i*)(4*i + kRound)));
+        s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+        s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    // Compute the next 4 message words into m2 from the previous 12
+    SHANI static inline void nextMessage(
+        __m128i m0,
+        __m128i m1,
+        __m128i &m2
+    )
+    {
+        m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+    }
+
+    SHANI static void transformNI(
+        uint32_t      *s,
+        const uint8_t *blocks,
+        size_t        nbBlocks
+    )
+    {
+        const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+        // Reorder state words as ABEF / CDGH, the layout sha256rnds2 works on
+        __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xB1);
+        __m128i t2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(4 + s)), 0x1B);
+        __m128i s0 = _mm_alignr_epi8(t1, t2, 0x08);
+        __m128i s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+        while(nbBlocks--) {
+
+            __m128i save0 = s0;
+            __m128i save1 = s1;
+
+            __m128i m[4];
+            for(int i=0; i<4; ++i) {
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(16*i + blocks)), swap);
+            }
+
+            // Words for rounds 16 and up: sha256msg1 starts them 8 rounds
+            // ahead of use, nextMessage completes them 4 rounds ahead
+            for(int i=0; i<16; ++i) {
+                quadRound(s0, s1, m[i & 3], i);
+                if(3<=i && i<=14) nextMessage(m[(i-1) & 3], m[i & 3], m[(i+1) & 3]);
+                if(1<=i && i<=12) m[(i-1) & 3] = _mm_sha256msg1_epu32(m[(i-1) & 3], m[i & 3]);
+            }
+
+            s0 = _mm_add_epi32(s0, save0);
+            s1 = _mm_add_epi32(s1, save1);
+            blocks += 64;
+        }
+
+        t1 = _mm_shuffle_epi32(s0, 0x1B);
+        t2 = _mm_shuffle_epi32(s1, 0xB1);
+        _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t1, t2, 0xF0));
+        _mm_storeu_si128((__m128i*)(4 + s), _mm_alignr_epi8(t2, t1, 0x08));
+    }
+
+#endif
+
+typedef void (*Transform)(uint32_t *s, const uint8_t *blocks, size_t nbBlocks);
+typedef void (*TransformLanes)(uint32_t *s, const uint8_t *const *blocks);
+
+struct Engine
+{
+    const char     *name;
+    Transform      transform;                   // Runs blocks of one message
+    TransformLanes transformLanes;              // Runs one block of each of nbLanes messages, 0 if none
+    int            nbLanes;
+};
+
+static const Engine *gEngine;
+
+static const Engine kScalar = { "scalar", transformScalar,            0, 1 };
+#if defined(SHA256_X86)
+    static const Engine kSSE4 = {   "sse4", transformScalar,   transform4, 4 };
+    static const Engine kAVX2 = {   "avx2", transformScalar,   transform8, 8 };
+    static const Engine kSHANI = { "shani",     transformNI,            0, 1 };
+#endif
+
+static bool supported(
+    const Engine *engine
+)
+{
+    #if defined(SHA256_X86)
+
+        unsigned int a, b, c, d;
+        if(!__get_cpuid(1, &a, &b, &c, &d)) return engine==&kScalar;
+        bool sse41 = (0!=(c & bit_SSE4_1));
+        bool ssse3 = (0!=(c & bit_SSSE3));
+        bool osxsave = (0!=(c & bit_OSXSAVE));
+
+        bool avx2 = false;
+        bool sha = false;
+        if(__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+            avx2 = (0!=(b & bit_AVX2));
+            sha = (0!=(b & bit_SHA));
+        }
+
+        // AVX2 also needs the OS to save ymm registers across context switches
+        if(avx2) {
+            uint32_t lo = 0, hi = 0;
+            if(osxsave) __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            avx2 = (6==(lo & 6));
+        }
+
+        if(engine==&kSSE4) return sse41;
+        if(engine==&kAVX2) return avx2;
+        if(engine==&kSHANI) return sha && sse41 && ssse3;
+
+    #endif
+
+    return engine==&kScalar;
+}
+
+static const Engine *const kEngines[] = {
+    #if defined(SHA256_X86)
+        &kSHANI,
+        &kAVX2,
+        &kSSE4,
+    #endif
+    &kScalar
+};
+
+static struct EngineInit
+{
+    EngineInit()
+    {
+        gEngine = &kScalar;
+        for(size_t i=0; i<sizeof(kEngines)/sizeof(kEngines[0]); ++i) {
+            if(supported(kEngines[i])) {
+                gEngine = kEngines[i];
+                break;
+            }
+        }
+    }
+} engineInit;
+
+const char *sha256Engine()
+{
+    return gEngine->name;
+}
+
+bool sha256SetEngine(
+    const char *name
+)
+{
+    for(size_t i=0; i<sizeof(kEngines)/sizeof(kEngines[0]); ++i) {
+        const Engine *engine = kEngines[i];
+        if(0!=strcmp(name, engine->name)) continue;
+        if(!supported(engine)) return false;
+        gEngine = engine;
+        return true;
+    }
+    return false;
+}
+
+// Pad the last (len % 64) bytes of a message into one or two blocks,
+// returns the number of blocks
+static inline size_t padTail(
+    uint8_t       *tail,
+    const uint8_t *data,
+    size_t        len
+)
+{
+    size_t rem = len % 64;
+    size_t nbTail = (rem<56) ? 1 : 2;
+    memcpy(tail, (len - rem) + data, rem);
+    tail[rem] = 0x80;
+    memset(1 + rem + tail, 0, 64*nbTail - rem - 1);
+
+    uint64_t bits = 8*(uint64_t)len;
+    uint8_t *end = 64*nbTail + tail;
+    storeBE(end - 8, (uint32_t)(bits>>32));
+    storeBE(end - 4, (uint32_t)bits);
+    return nbTail;
+}
+
+// The second round always hashes one 32 byte digest: a single block whose
+// padding never changes
+static inline void secondRound(
+    uint8_t        *result,
+    const uint32_t *first
+)
+{
+    uint8_t block[64];
+    for(int i=0; i<8; ++i) storeBE(4*i + block, first[i]);
+    memset(32 + block, 0, 32);
+    block[32] = 0x80;
+    block[62] = 0x01;                           // 256 bits
+
+    uint32_t s[8];
+    memcpy(s, kInit, sizeof(s));
+    gEngine->transform(s, block, 1);
+    for(int i=0; i<8; ++i) storeBE(4*i + result, s[i]);
+}
 
 void sha256(
     uint8_t       *result,
@@ -8,9 +350,168 @@ void sha256(
     size_t        len
 )
 {
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, data, len);
-    SHA256_Final(result, &sha256);
+    uint32_t s[8];
+    memcpy(s, kInit, sizeof(s));
+    gEngine->transform(s, data, len/64);
+
+    uint8_t tail[128];
+    size_t nbTail = padTail(tail, data, len);
+    gEngine->transform(s, tail, nbTail);
+    for(int i=0; i<8; ++i) storeBE(4*i + result, s[i]);
+}
+
+void sha256d(
+    uint8_t       *result,
+    const uint8_t *data,
+    size_t        len
+)
+{
+    uint32_t s[8];
+    memcpy(s, kInit, sizeof(s));
+
+    if(80==len) {
+
+        // Block headers: the second block is the last 16 header bytes
+        // followed by padding that is always the same
+        uint8_t block[64];
+        memcpy(block, 64 + data, 16);
+        memset(16 + block, 0, 48);
+        block[16] = 0x80;
+        block[62] = 0x02;                       // 640 bits
+        block[63] = 0x80;
+
+        gEngine->transform(s, data, 1);
+        gEngine->transform(s, block, 1);
+
+    } else {
+
+        gEngine->transform(s, data, len/64);
+
+        uint8_t tail[128];
+        size_t nbTail = padTail(tail, data, len);
+        gEngine->transform(s, tail, nbTail);
+    }
+
+    secondRound(result, s);
+}
+
+// Keeps every SIMD lane busy: a lane that finishes a message picks up the
+// next one, so messages of any mix of lengths share the lanes
+static void batchLanes(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *lens,
+    size_t               n
+)
+{
+    enum { kMaxLanes = 8 };
+
+    struct Lane
+    {
+        size_t  message;
+        size_t  block;
+        size_t  nbFull;
+        size_t  nbBlocks;
+        uint8_t tail[128];
+    };
+
+    static const uint8_t idle[64] = { 0 };
+
+    int nbLanes = gEngine->nbLanes;
+    TransformLanes transformLanes = gEngine->transformLanes;
+
+    Lane lanes[kMaxLanes];
+    uint32_t s[8*kMaxLanes];
+    const uint8_t *blocks[kMaxLanes];
+    std::vector<uint32_t> first(8*n);
+
+    size_t next = 0;
+    int nbActive = 0;
+    for(int l=0; l<nbLanes; ++l) {
+
+        Lane &lane = lanes[l];
+        lane.message = n;
+        if(n<=next) continue;
+
+        lane.message = next++;
+        lane.block = 0;
+        lane.nbFull = lens[lane.message]/64;
+        lane.nbBlocks = lane.nbFull + padTail(lane.tail, data[lane.message], lens[lane.message]);
+        for(int i=0; i<8; ++i) s[i*nbLanes + l] = kInit[i];
+        ++nbActive;
+    }
+
+    while(0<nbActive) {
+
+        for(int l=0; l<nbLanes; ++l) {
+            const Lane &lane = lanes[l];
+            if(n<=lane.message) blocks[l] = idle;
+            else if(lane.block<lane.nbFull) blocks[l] = 64*lane.block + data[lane.message];
+            else blocks[l] = 64*(lane.block - lane.nbFull) + lane.tail;
+        }
+
+        transformLanes(s, blocks);
+
+        for(int l=0; l<nbLanes; ++l) {
+
+            Lane &lane = lanes[l];
+            if(n<=lane.message) continue;
+            if(++lane.block<lane.nbBlocks) continue;
+
+            for(int i=0; i<8; ++i) first[8*lane.message + i] = s[i*nbLanes + l];
+
+            lane.message = n;
+            --nbActive;
+            if(n<=next) continue;
+
+            lane.message = next++;
+            lane.block = 0;
+            lane.nbFull = lens[lane.message]/64;
+            lane.nbBlocks = lane.nbFull + padTail(lane.tail, data[lane.message], lens[lane.message]);
+            for(int i=0; i<8; ++i) s[i*nbLanes + l] = kInit[i];
+            ++nbActive;
+        }
+    }
+
+    // Second rounds are single, fixed-layout blocks: run them nbLanes at a time
+    uint8_t second[kMaxLanes][64];
+    for(size_t start=0; start<n; start+=nbLanes) {
+
+        for(int l=0; l<nbLanes; ++l) {
+
+            blocks[l] = idle;
+            for(int i=0; i<8; ++i) s[i*nbLanes + l] = kInit[i];
+            if(n<=start + l) continue;
+
+            uint8_t *block = second[l];
+            for(int i=0; i<8; ++i) storeBE(4*i + block, first[8*(start + l) + i]);
+            memset(32 + block, 0, 32);
+            block[32] = 0x80;
+            block[62] = 0x01;
+            blocks[l] = block;
+        }
+
+        transformLanes(s, blocks);
+
+        for(int l=0; l<nbLanes && start + l<n; ++l) {
+            uint8_t *result = results[start + l];
+            for(int i=0; i<8; ++i) storeBE(4*i + result, s[i*nbLanes + l]);
+        }
+    }
+}
+
+void sha256dBatch(
+    uint8_t       *const *results,
+    const uint8_t *const *data,
+    const size_t         *lens,
+    size_t               n
+)
+{
+    // Not worth filling lanes for a single message
+    if(0==gEngine->transformLanes || n<2) {
+        for(size_t i=0; i<n; ++i) sha256d(results[i], data[i], lens[i]);
+        return;
+    }
+    batchLanes(results, data, lens, n);
 }
 
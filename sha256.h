@@ -10,5 +10,28 @@
         size_t        len
     );
 
+    // sha256(sha256(data)), with fast paths for the fixed size second round
+    // and for 80 byte block headers
+    void sha256d(
+        uint8_t       *result,
+        const uint8_t *data,
+        size_t        len
+    );
+
+    // sha256d of n independent messages. Engines that hash several messages
+    // at once in SIMD lanes (sse4, avx2) only pay off through this call
+    void sha256dBatch(
+        uint8_t       *const *results,
+        const uint8_t *const *data,
+        const size_t         *lens,
+        size_t               n
+    );
+
+    // Engines are "scalar", "sse4" (4 lanes), "avx2" (8 lanes) and "shani".
+    // The best one the CPU supports is picked at startup; sha256SetEngine
+    // returns false, and keeps the current engine, if the CPU lacks support
+    const char *sha256Engine();
+    bool sha256SetEngine(const char *name);
+
 #endif // __SHA256_H__
 
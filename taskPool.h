@@ -0,0 +1,156 @@
+#ifndef __TASKPOOL_H__
+    #define __TASKPOOL_H__
+
+    #include <deque>
+    #include <vector>
+    #include <common.h>
+    #include <boost/thread.hpp>
+
+    // Unit of work for a TaskPool
+    struct Task
+    {
+        virtual ~Task() {}
+        virtual void run() = 0;
+    };
+
+    // Fixed set of worker threads, each with a queue of its own. Tasks get
+    // dealt to the queues in turn; a worker whose queue runs dry steals from
+    // the others rather than sit idle while they are behind. Queues are
+    // served oldest first, owner and thieves alike, since whoever submits
+    // tasks here usually waits on them in submission order. Tasks get
+    // counted and claimed without a lock: idle workers only take one to
+    // sleep, and pushes only to wake them.
+    struct TaskPool
+    {
+        TaskPool(
+            size_t nbThreads
+        )
+        {
+            if(nbThreads<1) nbThreads = 1;
+            quit = false;
+            nbQueued = 0;
+            nbSleeping = 0;
+            nextQueue = 0;
+            queues.resize(nbThreads);
+            for(size_t i=0; i<nbThreads; ++i) queues[i] = new Queue;
+            for(size_t i=0; i<nbThreads; ++i) workers.add_thread(new boost::thread(work, this, i));
+        }
+
+        // Tasks still queued run before the workers exit
+        ~TaskPool()
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(idleMutex);
+                quit = true;
+                idleCond.notify_all();
+            }
+            workers.join_all();
+            for(size_t i=0; i<queues.size(); ++i) delete queues[i];
+        }
+
+        size_t nbThreads() const { return queues.size(); }
+
+        void push(
+            Task *task
+        )
+        {
+            Queue *queue = queues[nextQueue];
+            if(queues.size()<=++nextQueue) nextQueue = 0;
+            {
+                boost::lock_guard<boost::mutex> lock(queue->mutex);
+                queue->tasks.push_back(task);
+            }
+
+            // Both counts change through full barriers: either this sees a
+            // worker that went to sleep, or that worker sees the new task
+            __sync_fetch_and_add(&nbQueued, 1);
+            if(0<__sync_fetch_and_add(&nbSleeping, 0)) {
+                boost::lock_guard<boost::mutex> lock(idleMutex);
+                idleCond.notify_one();
+            }
+        }
+
+    private:
+        struct Queue
+        {
+            boost::mutex      mutex;
+            std::deque<Task*> tasks;
+        };
+
+        TaskPool(const TaskPool &);
+        TaskPool &operator=(const TaskPool &);
+
+        Task *pop(
+            Queue *queue
+        )
+        {
+            boost::lock_guard<boost::mutex> lock(queue->mutex);
+            if(queue->tasks.empty()) return 0;
+
+            Task *task = queue->tasks.front();
+            queue->tasks.pop_front();
+            return task;
+        }
+
+        // Own queue first, then the others, starting with the next one over
+        Task *find(
+            size_t id
+        )
+        {
+            size_t n = queues.size();
+            for(size_t i=0; i<n; ++i) {
+                Task *task = pop(queues[(id + i) % n]);
+                if(task) return task;
+            }
+            return 0;
+        }
+
+        // Take one off the count of queued tasks, if there is any left
+        bool claim()
+        {
+            size_t n = nbQueued;
+            while(0<n) {
+                size_t seen = __sync_val_compare_and_swap(&nbQueued, n, n - 1);
+                if(seen==n) return true;
+                n = seen;
+            }
+            return false;
+        }
+
+        static void work(
+            TaskPool *pool,
+            size_t   id
+        )
+        {
+            while(1) {
+
+                if(!pool->claim()) {
+                    boost::unique_lock<boost::mutex> lock(pool->idleMutex);
+                    __sync_fetch_and_add(&pool->nbSleeping, 1);
+                    while(0==pool->nbQueued && !pool->quit) pool->idleCond.wait(lock);
+                    __sync_fetch_and_sub(&pool->nbSleeping, 1);
+                    if(0==pool->nbQueued) break;
+                    continue;
+                }
+
+                // Counted tasks are in some queue, though maybe not yet ours
+                Task *task = 0;
+                while(0==task) task = pool->find(id);
+                task->run();
+            }
+        }
+
+        std::vector<Queue*> queues;
+        size_t nextQueue;                       // Queue the next task gets dealt to
+        boost::thread_group workers;
+
+        // Only workers with nothing to claim take the mutex, to sleep on
+        boost::mutex idleMutex;
+        boost::condition_variable idleCond;
+        volatile size_t nbQueued;               // Tasks pushed but not yet claimed
+        volatile size_t nbSleeping;             // Workers waiting on idleCond
+        bool quit;
+    };
+
+#endif // __TASKPOOL_H__
+
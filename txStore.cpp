@@ -0,0 +1,403 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <txStore.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct TableHeader
+{
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t pad;
+};
+
+static const uint64_t kTableMagic = 0x3230425458504221ULL; // "!BPXTB02"
+
+static size_t fileSize(
+    const std::string &name
+)
+{
+    struct stat statBuf;
+    int r = stat(name.c_str(), &statBuf);
+    return (r<0) ? 0 : statBuf.st_size;
+}
+
+static const void *mapFile(
+    const std::string &name,
+    size_t            size
+)
+{
+    if(0==size) return 0;
+
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if(fd<0) sysErrFatal("failed to open %s", name.c_str());
+
+    void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(((void*)-1)==p) sysErrFatal("failed to mmap %s", name.c_str());
+
+    ::close(fd);
+    return p;
+}
+
+static void resizeFile(
+    const std::string &name,
+    size_t            size
+)
+{
+    int r = ::truncate(name.c_str(), size);
+    if(r<0 && ENOENT!=errno) sysErrFatal("failed to truncate %s", name.c_str());
+}
+
+static FILE *appendFile(
+    const std::string &name
+)
+{
+    FILE *f = fopen(name.c_str(), "ab");
+    if(!f) sysErrFatal("failed to open %s for writing", name.c_str());
+    return f;
+}
+
+// TX hashes are uniformly distributed: their first 8 bytes make a good slot
+// index as they are. They come from wherever the TX sits, at any alignment
+static inline uint64_t slotIndex(
+    const uint8_t *txHash,
+    uint64_t      mask
+)
+{
+    uint64_t h;
+    memcpy(&h, txHash, sizeof(h));
+    return h & mask;
+}
+
+TXStore::TXStore()
+{
+    tableFD = -1;
+    table = 0;
+    tableSize = 0;
+    slots = 0;
+    mask = 0;
+    hashes = 0;
+    hashesSize = 0;
+    blocks = 0;
+    blocksSize = 0;
+    hashesFile = 0;
+    blocksFile = 0;
+    blockCount = 0;
+    txCount = 0;
+}
+
+TXStore::~TXStore()
+{
+    close();
+}
+
+void TXStore::open(
+    const std::string &prefix,
+    uint64_t          nbTXEstimate
+)
+{
+    tableName = prefix + ".txtable";
+    hashesName = prefix + ".txhashes";
+    blocksName = prefix + ".txblocks";
+
+    // Only trust the prefix of blocks whose TX hashes all made it to disk
+    size_t nbHashes = fileSize(hashesName) / sizeof(uint256_t);
+    blockCount = fileSize(blocksName) / sizeof(BlockRecord);
+    blocks = (const BlockRecord*)mapFile(blocksName, blockCount*sizeof(BlockRecord));
+    while(0<blockCount) {
+        const BlockRecord &last = blocks[blockCount-1];
+        if((last.firstTX + last.nbTX)<=nbHashes) break;
+        --blockCount;
+    }
+    if(blocks) munmap((void*)blocks, fileSize(blocksName));
+    blocks = 0;
+
+    uint64_t capacity = 1024;
+    while((capacity*7)<(nbTXEstimate*10)) capacity <<= 1;
+
+    bool fresh = true;
+    tableFD = ::open(tableName.c_str(), O_RDWR);
+    if(0<=tableFD) {
+        TableHeader header;
+        ssize_t r = pread(tableFD, &header, sizeof(header), 0);
+        size_t size = fileSize(tableName);
+        fresh = !(
+            sizeof(header)==r                                       &&
+            kTableMagic==header.magic                               &&
+            (sizeof(header) + header.capacity*sizeof(Slot))==size
+        );
+        if(!fresh) capacity = header.capacity;
+        ::close(tableFD);
+        tableFD = -1;
+    }
+
+    if(fresh) {
+        unlink(tableName.c_str());
+        blockCount = 0;
+    }
+    mapTable(capacity);
+
+    txCount = 0;
+    truncate(blockCount);
+
+    info(
+        "TX store: %" PRIu64 " blocks, %" PRIu64 " transactions",
+        blockCount,
+        txCount
+    );
+}
+
+void TXStore::mapTable(
+    uint64_t capacity
+)
+{
+    tableFD = ::open(tableName.c_str(), O_RDWR | O_CREAT, 0644);
+    if(tableFD<0) sysErrFatal("failed to open %s", tableName.c_str());
+
+    tableSize = sizeof(TableHeader) + capacity*sizeof(Slot);
+    if(fileSize(tableName)!=tableSize) {
+        int r = ftruncate(tableFD, tableSize);
+        if(r<0) sysErrFatal("failed to size %s", tableName.c_str());
+    }
+
+    void *p = mmap(0, tableSize, PROT_READ | PROT_WRITE, MAP_SHARED, tableFD, 0);
+    if(((void*)-1)==p) sysErrFatal("failed to mmap %s", tableName.c_str());
+
+    table = (uint8_t*)p;
+    slots = (Slot*)(sizeof(TableHeader) + table);
+    mask = capacity - 1;
+
+    TableHeader *header = (TableHeader*)table;
+    if(kTableMagic!=header->magic) {
+        header->magic = kTableMagic;
+        header->capacity = capacity;
+        header->count = 0;
+    }
+}
+
+void TXStore::insert(
+    Slot             *slotTable,
+    uint64_t         slotMask,
+    const uint8_t    *txHash,
+    const TXLocation &location
+)
+{
+    uint64_t i = slotIndex(txHash, slotMask);
+    while(1) {
+        Slot &slot = slotTable[i];
+        if(0==slot.location.height) {
+            memcpy(slot.hash.v, txHash, kSHA256ByteSize);
+            slot.location = location;
+            ++(((TableHeader*)table)->count);
+            return;
+        }
+        if(0==memcmp(slot.hash.v, txHash, kSHA256ByteSize)) {
+            slot.location = location;
+            return;
+        }
+        i = (i+1) & slotMask;
+    }
+}
+
+void TXStore::growTable()
+{
+    uint64_t capacity = 2*(mask + 1);
+    info("TX store: growing table to %" PRIu64 " slots", capacity);
+
+    std::string tmpName = tableName + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd<0) sysErrFatal("failed to create %s", tmpName.c_str());
+
+    size_t size = sizeof(TableHeader) + capacity*sizeof(Slot);
+    int r = ftruncate(fd, size);
+    if(r<0) sysErrFatal("failed to size %s", tmpName.c_str());
+
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(((void*)-1)==p) sysErrFatal("failed to mmap %s", tmpName.c_str());
+
+    uint8_t *oldTable = table;
+    Slot *oldSlots = slots;
+    uint64_t oldCapacity = mask + 1;
+
+    table = (uint8_t*)p;
+    TableHeader *header = (TableHeader*)table;
+    header->magic = kTableMagic;
+    header->capacity = capacity;
+    header->count = 0;
+
+    Slot *newSlots = (Slot*)(sizeof(TableHeader) + table);
+    for(uint64_t i=0; i<oldCapacity; ++i) {
+        const Slot &slot = oldSlots[i];
+        if(0!=slot.location.height) insert(newSlots, capacity-1, slot.hash.v, slot.location);
+    }
+
+    munmap(oldTable, tableSize);
+    ::close(tableFD);
+
+    r = rename(tmpName.c_str(), tableName.c_str());
+    if(r<0) sysErrFatal("failed to rename %s", tmpName.c_str());
+
+    tableFD = fd;
+    tableSize = size;
+    slots = newSlots;
+    mask = capacity - 1;
+}
+
+void TXStore::truncate(
+    uint64_t nbBlocks
+)
+{
+    if(blockCount<nbBlocks) nbBlocks = blockCount;
+
+    if(hashesFile) fclose(hashesFile);
+    if(blocksFile) fclose(blocksFile);
+    if(hashes) munmap((void*)hashes, hashesSize);
+    if(blocks) munmap((void*)blocks, blocksSize);
+
+    // TX entries of dropped blocks stay in the table: a valid chain only
+    // ever spends them again after re-including (and re-adding) them. With
+    // no block left, they go: nothing says where they point is still theirs
+    TableHeader *header = (TableHeader*)table;
+    if(0==nbBlocks && 0<header->count) {
+        int r = ftruncate(tableFD, 0);
+        if(0==r) r = ftruncate(tableFD, tableSize);
+        if(r<0) sysErrFatal("failed to clear %s", tableName.c_str());
+        header->magic = kTableMagic;
+        header->capacity = mask + 1;
+        header->count = 0;
+    }
+
+    resizeFile(blocksName, nbBlocks*sizeof(BlockRecord));
+    blocksSize = fileSize(blocksName);
+    blocks = (const BlockRecord*)mapFile(blocksName, blocksSize);
+
+    blockCount = nbBlocks;
+    txCount = 0;
+    if(0<blockCount) {
+        const BlockRecord &last = blocks[blockCount-1];
+        txCount = last.firstTX + last.nbTX;
+    }
+
+    resizeFile(hashesName, txCount*sizeof(uint256_t));
+    hashesSize = fileSize(hashesName);
+    hashes = (const uint256_t*)mapFile(hashesName, hashesSize);
+
+    hashesFile = appendFile(hashesName);
+    blocksFile = appendFile(blocksName);
+}
+
+const uint8_t *TXStore::blockHash(
+    uint64_t height
+) const
+{
+    return blocks[height-1].hash.v;
+}
+
+const uint8_t *TXStore::txHashes(
+    uint64_t height
+) const
+{
+    return hashes[blocks[height-1].firstTX].v;
+}
+
+TXLocation TXStore::blockLocation(
+    uint64_t height
+) const
+{
+    const BlockRecord &record = blocks[height-1];
+    TXLocation location;
+    location.fileId = record.fileId;
+    location.height = height;
+    location.offset = record.offset;
+    return location;
+}
+
+bool TXStore::find(
+    const uint8_t *txHash,
+    TXLocation    &location
+) const
+{
+    uint64_t i = slotIndex(txHash, mask);
+    while(1) {
+        const Slot &slot = slots[i];
+        if(unlikely(0==slot.location.height)) return false;
+        if(likely(0==memcmp(slot.hash.v, txHash, kSHA256ByteSize))) {
+            location = slot.location;
+            return true;
+        }
+        i = (i+1) & mask;
+    }
+}
+
+void TXStore::prefetch(
+    const uint8_t *txHash
+) const
+{
+    __builtin_prefetch(slots + slotIndex(txHash, mask));
+}
+
+void TXStore::add(
+    const uint8_t    *txHash,
+    const TXLocation &location
+)
+{
+    const TableHeader *header = (const TableHeader*)table;
+    if(unlikely((7*(mask + 1))<=(10*(header->count + 1)))) growTable();
+    insert(slots, mask, txHash, location);
+
+    size_t r = fwrite(txHash, kSHA256ByteSize, 1, hashesFile);
+    if(1!=r) sysErrFatal("failed to write %s", hashesName.c_str());
+    ++txCount;
+}
+
+void TXStore::addBlock(
+    const uint8_t *blockHash,
+    uint64_t      nbTX,
+    uint32_t      fileId,
+    uint64_t      offset
+)
+{
+    BlockRecord record;
+    memcpy(record.hash.v, blockHash, kSHA256ByteSize);
+    record.firstTX = txCount - nbTX;
+    record.nbTX = nbTX;
+    record.fileId = fileId;
+    record.pad = 0;
+    record.offset = offset;
+
+    size_t r = fwrite(&record, sizeof(record), 1, blocksFile);
+    if(1!=r) sysErrFatal("failed to write %s", blocksName.c_str());
+    ++blockCount;
+}
+
+void TXStore::flush()
+{
+    if(hashesFile) fflush(hashesFile);
+    if(blocksFile) fflush(blocksFile);
+}
+
+void TXStore::close()
+{
+    if(hashesFile) fclose(hashesFile);
+    if(blocksFile) fclose(blocksFile);
+    if(hashes) munmap((void*)hashes, hashesSize);
+    if(blocks) munmap((void*)blocks, blocksSize);
+    if(table) munmap(table, tableSize);
+    if(0<=tableFD) ::close(tableFD);
+
+    tableFD = -1;
+    table = 0;
+    slots = 0;
+    hashes = 0;
+    blocks = 0;
+    hashesFile = 0;
+    blocksFile = 0;
+}
+
@@ -0,0 +1,94 @@
+#ifndef __TXSTORE_H__
+    #define __TXSTORE_H__
+
+    #include <string>
+    #include <stdio.h>
+    #include <util.h>
+    #include <common.h>
+
+    // Where the outputs of a transaction live in the blk files
+    struct TXLocation
+    {
+        uint32_t fileId;                        // Index of blk file holding the TX
+        uint32_t height;                        // Height of block holding the TX, 0 marks an empty slot
+        uint64_t offset;                        // Offset of the TX's output array in blk file
+    };
+
+    // Persistent, mmap-able TX hash -> TXLocation table, plus the hash of every
+    // TX of the longest chain in chain order. Lets repeat runs of commands that
+    // need TX hashes skip both re-hashing transactions and rebuilding gTXMap.
+    //
+    // Made of three files sharing a prefix:
+    //
+    //     prefix.txtable   : open-addressed hash table of TXLocation
+    //     prefix.txhashes  : hashes of all TX, in chain order
+    //     prefix.txblocks  : hash, location and first TX of every block covered
+    //
+    // TX locations are only good for as long as blk files keep their layout:
+    // the parser checks every stored block is still where it was, and drops
+    // the store past the first one that moved.
+    //
+    struct TXStore
+    {
+        TXStore();
+        ~TXStore();
+
+        void open(const std::string &prefix, uint64_t nbTXEstimate);
+        void truncate(uint64_t nbBlocks);       // drop blocks at height > nbBlocks (reorg)
+        void flush();
+        void close();
+
+        uint64_t nbBlocks() const { return blockCount; }
+        const uint8_t *blockHash(uint64_t height) const;
+        const uint8_t *txHashes(uint64_t height) const;
+        TXLocation blockLocation(uint64_t height) const;   // Where the block's data was when stored
+
+        bool find(const uint8_t *txHash, TXLocation &location) const;
+        void prefetch(const uint8_t *txHash) const;
+        void add(const uint8_t *txHash, const TXLocation &location);
+        void addBlock(const uint8_t *blockHash, uint64_t nbTX, uint32_t fileId, uint64_t offset);
+
+    private:
+        struct Slot
+        {
+            uint256_t  hash;
+            TXLocation location;
+        };
+
+        struct BlockRecord
+        {
+            uint256_t hash;
+            uint64_t  firstTX;
+            uint64_t  nbTX;
+            uint32_t  fileId;                   // Where the block's data (past magic and size) was
+            uint32_t  pad;
+            uint64_t  offset;
+        };
+
+        void mapTable(uint64_t capacity);
+        void growTable();
+        void insert(Slot *slots, uint64_t mask, const uint8_t *txHash, const TXLocation &location);
+
+        std::string tableName;
+        std::string hashesName;
+        std::string blocksName;
+
+        int               tableFD;
+        uint8_t           *table;
+        size_t            tableSize;
+        Slot              *slots;
+        uint64_t          mask;
+
+        const uint256_t   *hashes;
+        size_t            hashesSize;
+        const BlockRecord *blocks;
+        size_t            blocksSize;
+
+        FILE              *hashesFile;
+        FILE              *blocksFile;
+        uint64_t          blockCount;
+        uint64_t          txCount;
+    };
+
+#endif // __TXSTORE_H__
+
@@ -6,6 +6,7 @@
 #include <rmd160.h>
 #include <sha256.h>
 #include <opcodes.h>
+#include <profile.h>
 #include <iostream>
 #include <cmath>
 
@@ -20,15 +21,6 @@
 const uint8_t hexDigits[] = "0123456789abcdef";
 const uint8_t b58Digits[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
-template<> uint8_t *PagedAllocator<Block>::pool = 0;
-template<> uint8_t *PagedAllocator<Block>::poolEnd = 0;
-
-template<> uint8_t *PagedAllocator<uint256_t>::pool = 0;
-template<> uint8_t *PagedAllocator<uint256_t>::poolEnd = 0;
-
-template<> uint8_t *PagedAllocator<uint160_t>::pool = 0;
-template<> uint8_t *PagedAllocator<uint160_t>::poolEnd = 0;
-
 double usecs()
 {
     struct timeval t;
@@ -243,6 +235,7 @@ int solveOutputScript(
     uint8_t       *type
 )
 {
+    ProfileTimer timer(kProfileSolveScript);
     type[0] = 0;
 
     // The most common output script type, pays to hash160(pubKey)
@@ -381,8 +374,9 @@ bool addrToHash160(
              bool verbose
 )
 {
-    static BIGNUM *sum = 0;
-    static BN_CTX *ctx = 0;
+    // Per thread: the multi command runs several commands' hooks at once
+    static __thread BIGNUM *sum = 0;
+    static __thread BN_CTX *ctx = 0;
     if(unlikely(!ctx)) {
         ctx = BN_CTX_new();
         BN_CTX_init(ctx);
@@ -491,11 +485,11 @@ void hash160ToAddr(
         1 + kRIPEMD160ByteSize
     );
 
-    static BIGNUM *b58 = 0;
-    static BIGNUM *num = 0;
-    static BIGNUM *div = 0;
-    static BIGNUM *rem = 0;
-    static BN_CTX *ctx = 0;
+    static __thread BIGNUM *b58 = 0;
+    static __thread BIGNUM *num = 0;
+    static __thread BIGNUM *div = 0;
+    static __thread BIGNUM *rem = 0;
+    static __thread BN_CTX *ctx = 0;
 
     if(!ctx)
     {
@@ -706,7 +700,7 @@ std::string pr128(
     const uint128_t &y
 )
 {
-    static char result[1024];
+    static __thread char result[1024];
     char *p = 1023+result;
     *(p--) = 0;
 
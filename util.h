@@ -6,6 +6,7 @@
     #include <common.h>
     #include <rmd160.h>
     #include <sha256.h>
+    #include <arena.h>
 
     typedef const uint8_t *Hash160;
     typedef const uint8_t *Hash256;
@@ -68,32 +69,10 @@
         Block         *next;
     };
 
-    template<
-        typename T,
-        size_t   kPageSize = 16384
-    >
-    struct PagedAllocator
-    {
-        static uint8_t *pool;
-        static uint8_t *poolEnd;
-        enum { kPageByteSize = sizeof(T)*kPageSize };
-
-        static uint8_t *alloc()
-        {
-            if(unlikely(poolEnd<=pool)) {
-                pool = (uint8_t*)malloc(kPageByteSize);
-                poolEnd = kPageByteSize + pool;
-            }
-
-            uint8_t *result = pool;
-            pool += sizeof(T);
-            return result;
-        }
-    };
-
-    static inline Block   *allocBlock()   { return (Block*)PagedAllocator<    Block>::alloc(); }
-    static inline uint8_t *allocHash256() { return         PagedAllocator<uint256_t>::alloc(); }
-    static inline uint8_t *allocHash160() { return         PagedAllocator<uint160_t>::alloc(); }
+    // Objects kept for the whole run, from this thread's arena
+    static inline Block   *allocBlock()   { return   (Block*)threadArena().alloc(sizeof(Block));      }
+    static inline uint8_t *allocHash256() { return (uint8_t*)threadArena().alloc(kSHA256ByteSize);    }
+    static inline uint8_t *allocHash160() { return (uint8_t*)threadArena().alloc(kRIPEMD160ByteSize); }
 
     #define WANT_DENSE
     #if defined(WANT_DENSE)
@@ -244,8 +223,7 @@
         uint64_t      size
     )
     {
-        sha256(sha, buf, size);
-        sha256(sha, sha, kSHA256ByteSize);
+        sha256d(sha, buf, size);
     }
 
     extern const uint8_t hexDigits[];
@@ -0,0 +1,184 @@
+
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <utxoSnapshot.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct UTXOSnapshotHeader
+{
+    uint64_t magic;
+    uint64_t height;
+    uint256_t blockHash;
+    uint64_t nbUTXO;
+};
+
+static const uint64_t kUTXOSnapshotMagic = 0x3130585455504221ULL; // "!BPUTX01"
+
+UTXOSnapshot::UTXOSnapshot()
+{
+    file = 0;
+    ok = false;
+    fd = -1;
+    map = 0;
+    mapSize = 0;
+    cursor = 0;
+    end = 0;
+    blockHeight = 0;
+    utxoCount = 0;
+    hash = 0;
+}
+
+UTXOSnapshot::~UTXOSnapshot()
+{
+    if(file) {
+        fclose(file);
+        unlink((name + ".tmp").c_str());
+    }
+    unload();
+}
+
+bool UTXOSnapshot::create(
+    const std::string &path,
+    uint64_t          height,
+    const uint8_t     *blockHash
+)
+{
+    name = path;
+    std::string tmpName = path + ".tmp";
+    file = fopen(tmpName.c_str(), "wb");
+    if(!file) {
+        sysErr("failed to create UTXO snapshot %s", tmpName.c_str());
+        return false;
+    }
+
+    // The UTXO count goes in on commit
+    UTXOSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kUTXOSnapshotMagic;
+    header.height = height;
+    memcpy(header.blockHash.v, blockHash, kSHA256ByteSize);
+
+    ok = (1==fwrite(&header, sizeof(header), 1, file));
+    utxoCount = 0;
+    return ok;
+}
+
+bool UTXOSnapshot::add(
+    const uint8_t *txHash,
+    const void    *utxo,
+    uint32_t      size
+)
+{
+    ok = ok && (1==fwrite(txHash, kSHA256ByteSize, 1, file));
+    ok = ok && (1==fwrite(&size, sizeof(size), 1, file));
+    ok = ok && (1==fwrite(utxo, size, 1, file));
+    ++utxoCount;
+    return ok;
+}
+
+bool UTXOSnapshot::commit()
+{
+    std::string tmpName = name + ".tmp";
+
+    long offset = (long)offsetof(UTXOSnapshotHeader, nbUTXO);
+    ok = ok && (0==fseek(file, offset, SEEK_SET));
+    ok = ok && (1==fwrite(&utxoCount, sizeof(utxoCount), 1, file));
+    ok = (0==fclose(file)) && ok;
+    file = 0;
+
+    if(ok) ok = (0==rename(tmpName.c_str(), name.c_str()));
+    if(!ok) {
+        sysErr("failed to write UTXO snapshot %s", name.c_str());
+        unlink(tmpName.c_str());
+    }
+    return ok;
+}
+
+bool UTXOSnapshot::load(
+    const std::string &path
+)
+{
+    unload();
+
+    fd = open(path.c_str(), O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(fd, &statBuf);
+    if(r<0) {
+        sysErr("failed to fstat UTXO snapshot %s", path.c_str());
+        unload();
+        return false;
+    }
+
+    mapSize = statBuf.st_size;
+    if(mapSize<sizeof(UTXOSnapshotHeader)) {
+        warning("ignoring truncated UTXO snapshot %s", path.c_str());
+        unload();
+        return false;
+    }
+
+    map = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(((void*)-1)==map) {
+        sysErr("failed to mmap UTXO snapshot %s", path.c_str());
+        map = 0;
+        unload();
+        return false;
+    }
+
+    const UTXOSnapshotHeader *header = (const UTXOSnapshotHeader*)map;
+    if(kUTXOSnapshotMagic!=header->magic) {
+        warning("ignoring corrupt UTXO snapshot %s", path.c_str());
+        unload();
+        return false;
+    }
+
+    blockHeight = header->height;
+    utxoCount = header->nbUTXO;
+    hash = header->blockHash.v;
+    cursor = (const uint8_t*)(1 + header);
+    end = mapSize + (const uint8_t*)map;
+    return true;
+}
+
+void UTXOSnapshot::unload()
+{
+    if(map) munmap(map, mapSize);
+    if(0<=fd) close(fd);
+
+    fd = -1;
+    map = 0;
+    mapSize = 0;
+    cursor = 0;
+    end = 0;
+    blockHeight = 0;
+    utxoCount = 0;
+    hash = 0;
+}
+
+bool UTXOSnapshot::next(
+    const uint8_t *&txHash,
+    const uint8_t *&utxo,
+    uint32_t      &size
+)
+{
+    if(unlikely(end<=cursor)) return false;
+    if(unlikely((size_t)(end - cursor)<kSHA256ByteSize + sizeof(size)))
+        errFatal("truncated UTXO snapshot");
+
+    txHash = cursor;
+    memcpy(&size, kSHA256ByteSize + cursor, sizeof(size));
+    utxo = sizeof(size) + kSHA256ByteSize + cursor;
+    cursor = size + utxo;
+
+    if(unlikely(end<cursor)) errFatal("truncated UTXO snapshot");
+    return true;
+}
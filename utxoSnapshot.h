@@ -0,0 +1,55 @@
+#ifndef __UTXOSNAPSHOT_H__
+    #define __UTXOSNAPSHOT_H__
+
+    #include <string>
+    #include <stdio.h>
+    #include <util.h>
+    #include <common.h>
+
+    // The UTXO set as it stood right after some block of the longest chain.
+    // A later run whose range starts past that block loads it instead of
+    // parsing every block ahead of its range, so that height ranges can go
+    // to independent parser runs.
+    //
+    // One file per snapshot: a header, then for each TX with unspent outputs
+    // its hash, the byte size of its UTXO, and the UTXO itself
+    struct UTXOSnapshot
+    {
+        UTXOSnapshot();
+        ~UTXOSnapshot();
+
+        // Writing: the file only shows up under its name once commit succeeds
+        bool create(const std::string &path, uint64_t height, const uint8_t *blockHash);
+        bool add(const uint8_t *txHash, const void *utxo, uint32_t size);
+        bool commit();
+
+        // Reading: mmap and validate an existing snapshot, false if there is none
+        bool load(const std::string &path);
+        void unload();
+
+        uint64_t           height() const { return blockHeight; }
+        uint64_t           nbUTXO() const { return utxoCount;   }
+        const uint8_t  *blockHash() const { return hash;        }
+
+        // Walk the UTXOs of a loaded snapshot, false past the last one. The
+        // TX hashes handed out stay valid until unload
+        bool next(const uint8_t *&txHash, const uint8_t *&utxo, uint32_t &size);
+
+    private:
+        std::string   name;
+        FILE          *file;
+        bool          ok;
+
+        int           fd;
+        void          *map;
+        size_t        mapSize;
+        const uint8_t *cursor;
+        const uint8_t *end;
+
+        uint64_t      blockHeight;
+        uint64_t      utxoCount;
+        const uint8_t *hash;
+    };
+
+#endif // __UTXOSNAPSHOT_H__
+